@@ -0,0 +1,102 @@
+#!/bin/sh
+# Benchmark fsel on synthetic trees of growing size.
+# Usage: bench.sh [SIZE...]   (default: 1000 10000 100000 1000000 10000000)
+#
+# Prints one tab-separated line per measurement after a header:
+#   shape  paths  op  seconds
+# Shapes: shallow (1000 short names per directory), deep (64 names per
+# directory, nested about nine levels at 10^7) and long (names of ~200 bytes).
+# The hash-murmur3 and hash-sha256 rows give seconds per path hashed.
+# Environment: FSEL (binary, default ./fsel), FSEL_BENCH (fsel-bench binary
+# for the hash rows, which are left out without it), BENCH_SHAPES (default all
+# three), BENCH_DIR (scratch directory, removed afterwards unless
+# BENCH_KEEP=1).
+set -eu
+
+FSEL=$(cd "$(dirname "${FSEL:-./fsel}")" && pwd)/$(basename "${FSEL:-./fsel}")
+[ -z "${FSEL_BENCH:-}" ] || FSEL_BENCH=$(cd "$(dirname "$FSEL_BENCH")" && pwd)/$(basename "$FSEL_BENCH")
+SHAPES=${BENCH_SHAPES:-shallow deep long}
+DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/fsel-bench.$$}
+[ $# -gt 0 ] || set -- 1000 10000 100000 1000000 10000000
+
+# Keep the runs away from the user's selection and any running daemon
+mkdir -p "$DIR/store"
+export TMPDIR="$DIR/store" XDG_RUNTIME_DIR="$DIR/store" FSEL_NO_DAEMON=1
+[ "${BENCH_KEEP:-0}" = 1 ] || trap 'rm -rf "$DIR"' EXIT
+
+# Paths of file i of n in a shape, one per line
+paths() {
+    awk -v shape="$1" -v n="$2" -v root="$DIR/tree" 'BEGIN {
+        pad = sprintf("%180s", ""); gsub(/ /, "x", pad)
+        for (i = 0; i < n; i++) {
+            if (shape == "deep") {
+                dir = root "/deep"
+                for (j = int(i / 64); j > 0; j = int(j / 4)) dir = dir "/d" (j % 4)
+                print dir "/f" i
+            } else if (shape == "long") {
+                print root "/long/" pad int(i / 1000) "/" pad i
+            } else {
+                print root "/shallow/s" int(i / 1000) "/f" i
+            }
+        }
+    }'
+}
+
+report() {
+    awk -v s="$4" -v e="$5" -v shape="$1" -v size="$2" -v op="$3" \
+        'BEGIN { printf "%s\t%s\t%s\t%.6f\n", shape, size, op, (e - s) / 1e9 }'
+}
+
+# Time one fsel run: shape, size, op name, then the command
+measure() {
+    shape=$1 size=$2 op=$3
+    shift 3
+    start=$(date +%s%N)
+    "$@"
+    report "$shape" "$size" "$op" "$start" "$(date +%s%N)"
+}
+
+# Listing modes need a terminal on stdin, fsel reads paths otherwise. The
+# command is timed inside the terminal session to leave out its setup.
+measure_tty() {
+    cmd="s=\$(date +%s%N); $4; echo \$s \$(date +%s%N) > '$DIR/time'"
+    if [ -t 0 ]; then
+        sh -c "$cmd"
+    else
+        script -qec "$cmd" /dev/null </dev/null >/dev/null
+    fi
+    read -r start end < "$DIR/time"
+    report "$1" "$2" "$3" "$start" "$end"
+}
+
+reset_store() {
+    rm -rf "$DIR/store"
+    mkdir -p "$DIR/store"
+}
+
+printf 'shape\tpaths\top\tseconds\n'
+for size in "$@"; do
+    for shape in $SHAPES; do
+        rm -rf "$DIR/tree"
+        paths "$shape" "$size" > "$DIR/list"
+        sed 's|/[^/]*$||' "$DIR/list" | uniq | xargs mkdir -p
+        xargs touch < "$DIR/list"
+        awk 'NR % 2' "$DIR/list" > "$DIR/half"
+        cat "$DIR/list" "$DIR/list" "$DIR/list" "$DIR/list" > "$DIR/dups"
+
+        reset_store
+        measure "$shape" "$size" add sh -c '"$1" -q < "$2"' - "$FSEL" "$DIR/list"
+        measure "$shape" "$size" readd sh -c '"$1" -q < "$2"' - "$FSEL" "$DIR/list"
+        measure_tty "$shape" "$size" list "'$FSEL' > /dev/null"
+        measure_tty "$shape" "$size" sort "'$FSEL' -s > /dev/null"
+        measure_tty "$shape" "$size" sort-indexed "'$FSEL' -s > /dev/null"
+        measure_tty "$shape" "$size" long "'$FSEL' -l > /dev/null"
+        measure_tty "$shape" "$size" validate "'$FSEL' -v -q > /dev/null"
+        measure "$shape" "$size" delete sh -c '"$1" -q -d < "$2"' - "$FSEL" "$DIR/half"
+        measure "$shape" "$size" compact "$FSEL" --compact -q
+        [ -z "${FSEL_BENCH:-}" ] || "$FSEL_BENCH" --hash-bench < "$DIR/list" | awk -v shape="$shape" -v size="$size" \
+            '/ns\/path/ { printf "%s\t%s\thash-%s\t%.9f\n", shape, size, $1, $2 / 1e9 }'
+        reset_store
+        measure "$shape" "$size" add-dups sh -c '"$1" -q < "$2"' - "$FSEL" "$DIR/dups"
+    done
+done
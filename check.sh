@@ -0,0 +1,293 @@
+#!/bin/sh
+# Regression checks for fsel, run against a private $TMPDIR.
+# Usage: check.sh
+#
+# Environment: FSEL (binary, default ./fsel).
+set -eu
+
+FSEL=$(cd "$(dirname "${FSEL:-./fsel}")" && pwd)/$(basename "${FSEL:-./fsel}")
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fsel-check.XXXXXX")
+export TMPDIR="$DIR/store" XDG_RUNTIME_DIR="$DIR/store"
+mkdir -p "$TMPDIR" "$DIR/tree"
+daemon=
+trap '[ -z "$daemon" ] || kill "$daemon" 2>/dev/null; rm -rf "$DIR"' EXIT
+failed=0
+
+fail() {
+    echo "FAIL: $*" >&2
+    failed=1
+}
+
+# Listing modes need a terminal on stdin, fsel reads paths otherwise
+list() {
+    script -qec "'$FSEL' $*" /dev/null </dev/null | tr -d '\r'
+}
+
+# fsel on the selection files themselves, whether or not a daemon runs
+direct() {
+    FSEL_NO_DAEMON=1 "$FSEL" "$@" </dev/null
+}
+
+# Storage file of selection $1 with suffix $2
+store() {
+    echo "$TMPDIR/fsel_$(id -u)_$1.$2"
+}
+
+touch "$DIR/tree/a" "$DIR/tree/b"
+
+# A selected directory is moved before the selected paths under it, which
+# go along with it instead of into the target on their own
+mkdir -p "$DIR/tree/d/e" "$DIR/moved"
+touch "$DIR/tree/d/e/f" "$DIR/tree/d/g"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S mv "$DIR/tree/d/e/f" "$DIR/tree/d/g" "$DIR/tree/d" "$DIR/tree/d/e" </dev/null
+FSEL_NO_DAEMON=1 "$FSEL" -q -S mv -j 4 --mv "$DIR/moved" </dev/null || fail "--mv: nested paths failed"
+[ "$(cd "$DIR/moved" && find . | sort | tr '\n' ' ')" = ". ./d ./d/e ./d/e/f ./d/g " ] ||
+    fail "--mv: nested paths moved apart from their directory"
+
+# Duplicates are caught through the index, which is rebuilt from the
+# selection when it is missing or damaged
+direct -q -S ix "$DIR/tree/a" "$DIR/tree/b"
+direct -q -S ix "$DIR/tree/a"
+[ "$(list -S ix | wc -l)" -eq 2 ] || fail "index: duplicate added"
+rm "$(store ix idx)"
+direct -q -S ix "$DIR/tree/b"
+[ "$(list -S ix | wc -l)" -eq 2 ] || fail "index: duplicate added after losing the index"
+printf 'XXXXXXXX' | dd of="$(store ix idx)" conv=notrunc 2>/dev/null
+direct -q -S ix "$DIR/tree/a"
+[ "$(list -S ix)" = "$(printf '%s\n' "$DIR/tree/a" "$DIR/tree/b")" ] ||
+    fail "index: damaged index not rebuilt"
+
+# The totals come from the index header counters, which are rebuilt when
+# the selection was changed behind fsel's back
+direct -q -S cn "$DIR/tree/a" "$DIR/tree/b"
+[ "$(direct -S cn -d "$DIR/tree/a")" = "1 paths removed / 1 paths total" ] || fail "counters: after delete"
+touch "$DIR/tree/c"
+echo "$DIR/tree/c" >> "$(store cn tmp)"
+[ "$(direct -S cn "$DIR/tree/c" "$DIR/tree/a")" = "1 paths added / 3 paths total" ] ||
+    fail "counters: stale after an outside change"
+
+# An index keeps the hash function it was created with (header word 21,
+# FSEL_HASH only picks it for new ones) and an older format (word 2) is
+# rebuilt
+header_word() {
+    od -An -tu4 -j $(($2 * 4)) -N4 "$1" | tr -d ' '
+}
+FSEL_HASH=sha256 direct -q -S h256 "$DIR/tree/a"
+[ "$(header_word "$(store h256 idx)" 21)" = 2 ] || fail "hash: FSEL_HASH=sha256 not recorded"
+direct -q -S hmm "$DIR/tree/a"
+FSEL_HASH=sha256 direct -q -S hmm "$DIR/tree/a" "$DIR/tree/b"
+[ "$(header_word "$(store hmm idx)" 21)" = 1 ] || fail "hash: FSEL_HASH changed an existing index"
+[ "$(list -S hmm | wc -l)" -eq 2 ] || fail "hash: duplicate added under another FSEL_HASH"
+printf '\002' | dd of="$(store hmm idx)" bs=1 seek=8 conv=notrunc 2>/dev/null
+direct -q -S hmm "$DIR/tree/b"
+[ "$(header_word "$(store hmm idx)" 2)" = 3 ] && [ "$(list -S hmm | wc -l)" -eq 2 ] ||
+    fail "hash: older index format not rebuilt"
+
+# A deleted path's slot is reused by the next path of the same length
+direct -q -S fl "$DIR/tree/a" "$DIR/tree/b"
+size=$(wc -c < "$(store fl tmp)")
+direct -q -S fl -d "$DIR/tree/a"
+direct -q -S fl "$DIR/tree/c"
+[ "$(wc -c < "$(store fl tmp)")" -eq "$size" ] || fail "free list: slot not reused"
+[ "$(list -S fl)" = "$(printf '%s\n' "$DIR/tree/c" "$DIR/tree/b")" ] ||
+    fail "free list: reused slot listed out of place"
+
+# Deletes go through the index, also when it has to be rebuilt first, and
+# count only paths that were selected
+direct -q -S dl "$DIR/tree/a" "$DIR/tree/b" "$DIR/tree/c"
+[ "$(direct -S dl -d "$DIR/tree/b" "$DIR/tree/none")" = "1 paths removed / 2 paths total" ] ||
+    fail "delete: wrong count"
+rm "$(store dl idx)"
+direct -q -S dl -d "$DIR/tree/a"
+[ "$(list -S dl)" = "$DIR/tree/c" ] || fail "delete: failed without an index"
+
+# --range windows count live lines in selection order, or in path order
+# with -s, and survive a lost line table
+direct -q -S rg "$DIR/tree/c" "$DIR/tree/a" "$DIR/tree/b"
+[ "$(list -S rg --range 1:1)" = "$DIR/tree/a" ] || fail "range: wrong window"
+[ "$(list -S rg -s --range 1:2)" = "$(printf '%s\n' "$DIR/tree/b" "$DIR/tree/c")" ] ||
+    fail "range: wrong sorted window"
+direct -q -S rg -d "$DIR/tree/c"
+rm "$(store rg off)"
+[ "$(list -S rg --range 1:5)" = "$DIR/tree/b" ] || fail "range: wrong window after a delete"
+
+# A selection larger than FSEL_SORT_MEMORY is sorted in spilled runs, in
+# the same byte order as sort(1)
+direct -q -S sp "$DIR/tree/a"
+awk -v d="$DIR/tree" 'BEGIN { srand(7); for (i = 0; i < 20000; i++)
+    printf "%s/%08d-%066d\n", d, int(rand() * 1e8), i }' >> "$(store sp tmp)"
+FSEL_SORT_INDEX=0 FSEL_SORT_MEMORY=1M list -S sp -s > "$DIR/spilled"
+LC_ALL=C sort "$(store sp tmp)" | cmp -s - "$DIR/spilled" || fail "sort: spilled runs out of order"
+! FSEL_SORT_MEMORY=1023K direct -S sp -s >/dev/null 2>&1 || fail "sort: FSEL_SORT_MEMORY below 1M accepted"
+
+# The sort index written by the first -s follows later adds and deletes
+direct -q -S si "$DIR/tree/c" "$DIR/tree/a"
+list -S si -s >/dev/null
+[ -s "$(store si sort)" ] || fail "sort index: not written"
+direct -q -S si "$DIR/tree/b"
+[ "$(list -S si -s)" = "$(printf '%s\n' "$DIR/tree/a" "$DIR/tree/b" "$DIR/tree/c")" ] ||
+    fail "sort index: add not folded in"
+direct -q -S si -d "$DIR/tree/a"
+[ "$(list -S si -s)" = "$(printf '%s\n' "$DIR/tree/b" "$DIR/tree/c")" ] ||
+    fail "sort index: delete not folded in"
+
+# Deleting the last path trims the selection, --compact reclaims the rest
+direct -q -S cp "$DIR/tree/a" "$DIR/tree/b" "$DIR/tree/c"
+direct -q -S cp -d "$DIR/tree/c"
+[ "$(wc -c < "$(store cp tmp)")" -eq $((2 * (${#DIR} + 8))) ] || fail "compact: tail not trimmed"
+direct -q -S cp -d "$DIR/tree/a"
+direct -q -S cp --compact
+[ "$(cat "$(store cp tmp)")" = "$DIR/tree/b" ] || fail "compact: space not reclaimed"
+[ "$(list -S cp)" = "$DIR/tree/b" ] || fail "compact: wrong listing"
+
+# A packed selection lists the same paths, refuses changes and unpacks
+# back to the same selection
+direct -q -S pk "$DIR/tree/b" "$DIR/tree/a"
+before=$(list -S pk)
+direct -q -S pk --pack
+[ -f "$(store pk pack)" ] && [ ! -e "$(store pk tmp)" ] || fail "pack: not packed"
+[ "$(list -S pk)" = "$before" ] || fail "pack: packed listing differs"
+! direct -q -S pk "$DIR/tree/c" 2>/dev/null || fail "pack: add to a packed selection accepted"
+direct -q -S pk --unpack
+[ ! -e "$(store pk pack)" ] && [ "$(list -S pk)" = "$before" ] || fail "pack: unpacked listing differs"
+
+# --under picks a directory and what lies below it, not its siblings that
+# share its name as a prefix
+mkdir -p "$DIR/up/u/v" "$DIR/up/uv"
+touch "$DIR/up/a" "$DIR/up/u/v/x" "$DIR/up/u/y" "$DIR/up/uv/z"
+direct -q -S un "$DIR/up/u/y" "$DIR/up/uv/z" "$DIR/up/u" "$DIR/up/a" "$DIR/up/u/v/x" "$DIR/up/u/v"
+[ "$(list -S un --under "$DIR/up/u" | tr '\n' ' ')" = \
+    "$DIR/up/u $DIR/up/u/v $DIR/up/u/v/x $DIR/up/u/y " ] || fail "under: wrong listing"
+[ "$(list -S un --counts --under "$DIR/up/u")" = "$(printf '2\t%s\n1\t%s\n' "$DIR/up/u/v" "$DIR/up/u/y")" ] ||
+    fail "under: wrong counts"
+[ "$(direct -S un -d --under "$DIR/up/u")" = "4 paths removed / 2 paths total" ] ||
+    fail "under: wrong removal"
+
+# Paths repeated within one batch, however they are spelled, are added once
+(cd "$DIR/tree" && direct -q -S ba a ./a b ../tree/a b)
+printf '%s\n' "$DIR/tree/c" "$DIR/tree/b" "$DIR/tree/c" | FSEL_NO_DAEMON=1 "$FSEL" -q -S ba
+[ "$(list -S ba)" = "$(printf '%s\n' "$DIR/tree/a" "$DIR/tree/b" "$DIR/tree/c")" ] ||
+    fail "batch: duplicate within a batch added"
+
+# Parallel ingestion keeps input order and drops duplicates across chunks
+mkdir -p "$DIR/many"
+(cd "$DIR/many" && seq -f 'f%g' 2000 | xargs touch)
+seq -f "$DIR/many/f%g" 2000 > "$DIR/many.in"
+seq -f "$DIR/many/f%g" 2000 | sort -r >> "$DIR/many.in"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S j1 -j 1 < "$DIR/many.in"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S j4 -j 4 < "$DIR/many.in"
+cmp -s "$(store j1 tmp)" "$(store j4 tmp)" && [ "$(list -S j4 | wc -l)" -eq 2000 ] ||
+    fail "-j: parallel add differs from a serial one"
+
+# Validation finds the same missing paths with one worker or several
+rm "$DIR/many/f7" "$DIR/many/f1500"
+for j in 1 4; do
+    direct -S j4 -v -j $j --invalid > "$DIR/invalid" && fail "validate: -j $j succeeded with missing paths"
+    [ "$(grep -c '^✗' "$DIR/invalid")" -eq 2 ] && grep -q "^✗ $DIR/many/f1500$" "$DIR/invalid" ||
+        fail "validate: -j $j missed a missing path"
+done
+
+# -l names the owner and group of each path, in selection order
+direct -q -S lf "$DIR/tree/b" "$DIR/tree/a"
+list -S lf -l > "$DIR/long"
+[ "$(awk '{ print $3, $4, $NF }' "$DIR/long" | tr '\n' ' ')" = \
+    "$(id -un) $(id -gn) $DIR/tree/b $(id -un) $(id -gn) $DIR/tree/a " ] || fail "-l: wrong owner or order"
+
+# Listing into a file or a pipe copies the live lines straight from the
+# selection, skipping removed ones
+direct -q -S zc "$DIR/tree/a" "$DIR/tree/b" "$DIR/tree/c"
+direct -q -S zc -d "$DIR/tree/b"
+script -qec "'$FSEL' -S zc > '$DIR/zc.file'" /dev/null </dev/null >/dev/null
+[ "$(cat "$DIR/zc.file")" = "$(printf '%s\n' "$DIR/tree/a" "$DIR/tree/c")" ] || fail "list: wrong output to a file"
+script -qec "'$FSEL' -S zc | cat > '$DIR/zc.pipe'" /dev/null </dev/null >/dev/null
+cmp -s "$DIR/zc.file" "$DIR/zc.pipe" || fail "list: wrong output to a pipe"
+
+# Paths in a directory already resolved come from the realpath cache, which
+# still follows symlinks and .. the way realpath(3) does
+ln -s up/u/v "$DIR/link"
+printf '%s\n' "$DIR/link/x" "$DIR/link/../y" "$DIR/up/u/v/x" "$DIR/link/../y" |
+    FSEL_NO_DAEMON=1 "$FSEL" -q -S rp
+[ "$(list -S rp)" = "$(printf '%s\n' "$DIR/up/u/v/x" "$DIR/up/u/y")" ] ||
+    fail "realpath cache: wrong resolution"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S rc --stats < "$DIR/many.in" 2>&1 >/dev/null |
+    grep -q '^realpath cache: [1-9][0-9]* hits' || fail "realpath cache: no hits"
+
+# --stats reports on stderr only, as a table or as one JSON object
+[ -z "$(direct -q -S st --stats "$DIR/tree/a" 2>/dev/null)" ] || fail "--stats: report on stdout"
+direct -q -S st --stats "$DIR/tree/b" 2>&1 | grep -q '^total ' || fail "--stats: no total"
+direct -q -S st --stats=json "$DIR/tree/c" 2>&1 | grep -q '^{"status":0,.*"phases":{.*}$' ||
+    fail "--stats=json: wrong report"
+
+# A request for a named selection must not leave the daemon serving that
+# selection to the next default request
+FSEL_NO_DAEMON=1 "$FSEL" -q "$DIR/tree/a" </dev/null
+FSEL_NO_DAEMON=1 "$FSEL" -q -S x "$DIR/tree/b" </dev/null
+TZ=UTC0 "$FSEL" --daemon -q </dev/null &
+daemon=$!
+i=0
+while [ ! -S "$XDG_RUNTIME_DIR/fsel.sock" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+[ "$(list -S x)" = "$DIR/tree/b" ] || fail "daemon: -S x lists the wrong paths"
+[ "$(list)" = "$DIR/tree/a" ] || fail "daemon: default request after -S x"
+# A declined request falls back to direct access with the same paths, so
+# the daemon is told apart by its own time zone in the long listing
+[ "$(TZ=XYZ-5 list -l)" = "$(TZ=UTC0 FSEL_NO_DAEMON=1 list -l)" ] ||
+    fail "daemon: declined a default request after -S x"
+"$FSEL" -q "$DIR/tree/b" </dev/null
+[ "$(FSEL_NO_DAEMON=1 list -S x)" = "$DIR/tree/b" ] || fail "daemon: default add went into -S x"
+
+# -R adds everything under a root, opening subdirectories from their parent
+mkdir -p "$DIR/walk/a/b/c" "$DIR/walk/d"
+touch "$DIR/walk/a/x" "$DIR/walk/a/b/c/y" "$DIR/walk/d/z"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S walk -R -j 4 "$DIR/walk" </dev/null || fail "-R: walk failed"
+[ "$(FSEL_NO_DAEMON=1 list -S walk | sort)" = "$(find "$DIR/walk" | sort)" ] || fail "-R: wrong paths"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S walkf -R --type f --maxdepth 2 "$DIR/walk" </dev/null
+[ "$(FSEL_NO_DAEMON=1 list -S walkf | sort | tr '\n' ' ')" = "$DIR/walk/a/x $DIR/walk/d/z " ] ||
+    fail "-R: --type f --maxdepth 2"
+
+# A held lock makes changes wait up to --timeout, -u reports it without
+# removing anything and -f goes ahead unlocked
+flock -x "$TMPDIR/fsel_$(id -u)_lk.lock" sleep 2 &
+sleep 0.2
+FSEL_NO_DAEMON=1 "$FSEL" -q -S lk --timeout 0.3 "$DIR/tree/a" </dev/null 2>/dev/null &&
+    fail "--timeout: added under a held lock"
+[ "$(FSEL_NO_DAEMON=1 "$FSEL" -S lk -u 2>/dev/null)" = "Selection is locked by a running fsel process" ] ||
+    fail "-u: held lock not reported"
+[ -e "$TMPDIR/fsel_$(id -u)_lk.lock" ] || fail "-u: removed the lock file"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S lk -f "$DIR/tree/a" </dev/null || fail "-f: blocked by the lock"
+wait $!
+
+# -x hands every path to the command exactly once and, with --stats,
+# reports each job with its status
+FSEL_NO_DAEMON=1 "$FSEL" -q -S exec "$DIR/tree/a" "$DIR/tree/b" </dev/null
+OUT="$DIR/exec.out" FSEL_NO_DAEMON=1 "$FSEL" -q -S exec -x 'printf "%s\n" "$@" >> "$OUT"' </dev/null ||
+    fail "-x: command failed"
+[ "$(sort "$DIR/exec.out" 2>/dev/null)" = "$(printf '%s\n' "$DIR/tree/a" "$DIR/tree/b")" ] ||
+    fail "-x: paths not passed once each"
+FSEL_NO_DAEMON=1 "$FSEL" -S exec --stats -x 'true' </dev/null 2>&1 >/dev/null |
+    grep -q '^Job 1 (2 paths from .*) exited with status 0$' || fail "-x --stats: no report of a good job"
+
+# Set operations only read their operands: a reader holding a shared lock
+# on one does not stop them, and a stale operand index is rebuilt first
+FSEL_NO_DAEMON=1 "$FSEL" -q -S sx "$DIR/tree/a" "$DIR/tree/b" </dev/null
+FSEL_NO_DAEMON=1 "$FSEL" -q -S sy "$DIR/tree/b" </dev/null
+flock -s "$TMPDIR/fsel_$(id -u)_sy.lock" sleep 2 &
+sleep 0.2
+FSEL_NO_DAEMON=1 "$FSEL" -q -S sz --timeout 0.5 --union sx sy </dev/null ||
+    fail "setop: blocked by a reader of an operand"
+wait $!
+[ "$(FSEL_NO_DAEMON=1 list -S sz)" = "$(printf '%s\n' "$DIR/tree/a" "$DIR/tree/b")" ] ||
+    fail "setop: --union result"
+# Byte 80 is the dirty flag of the index header
+printf '\001' | dd of="$TMPDIR/fsel_$(id -u)_sy.idx" bs=1 seek=80 conv=notrunc 2>/dev/null
+FSEL_NO_DAEMON=1 "$FSEL" -q -S sz --intersect sz sy </dev/null || fail "setop: stale operand index"
+[ "$(FSEL_NO_DAEMON=1 list -S sz)" = "$DIR/tree/b" ] || fail "setop: --intersect result"
+FSEL_NO_DAEMON=1 "$FSEL" -q -S sd --diff sx sy </dev/null
+FSEL_NO_DAEMON=1 "$FSEL" -q -S sx --diff sx sy </dev/null
+[ "$(FSEL_NO_DAEMON=1 list -S sd)" = "$DIR/tree/a" ] && [ "$(FSEL_NO_DAEMON=1 list -S sx)" = "$DIR/tree/a" ] ||
+    fail "setop: --diff result"
+
+[ $failed -eq 0 ] && echo "All checks passed"
+exit $failed
@@ -1,7 +1,4 @@
 # Like a "cp" command, but for selected by "fsel" files.
 function cps
-    for f in (fsel)
-        cp -a $f $argv
-    end
+    fsel --cp $argv[1]
 end
-
@@ -1,3 +1,4 @@
 #!/bin/sh
-# Like a "cp" command, but for selected by "fargs" files.
-for f in $(fsel); do cp -a $f $argv; done
+# Like a "cp" command, but for selected by "fsel" files.
+# Usage: cps DEST
+exec fsel --cp "$1"
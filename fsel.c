@@ -14,24 +14,128 @@
  */
 
 #define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <glob.h>
 #include <grp.h>
 #include <libgen.h>
 #include <limits.h>
-#include <openssl/evp.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <openssl/sha.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
-#define HASH_SIZE SHA256_DIGEST_LENGTH
+
+// Paths are keyed by 128-bit hashes. MurmurHash3 is the default, SHA-256
+// (truncated) stays available through FSEL_HASH=sha256.
+#define HASH_SIZE 16
+#define HASH_MURMUR3 1
+#define HASH_SHA256 2
+
+// Index file is an open-addressing hash table keyed by path hash
+#define INDEX_MAGIC "FSELIDX"
+#define INDEX_VERSION 3
+#define INDEX_MIN_BUCKETS 1024
+
+// Free-list file keeps tombstoned slots bucketed by their length
+#define FREE_MAGIC "FSELFRE"
+#define FREE_VERSION 1
+#define FREE_MAX_SLOT PATH_MAX
+#define FREE_MIN_CAPACITY 256
+
+// Line table maps every storage line to its byte offset and length
+#define LINES_MAGIC "FSELOFF"
+#define LINES_VERSION 2
+#define LINES_MIN_CAPACITY 1024
+#define LINE_ACTIVE 0x1
+
+// Sort index lists the lines of active paths in path order. Adds collect
+// in a sorted pending part, folded into the main part once it outgrows a
+// sixteenth of it; deletes only clear line flags, so readers skip them.
+#define SORT_MAGIC "FSELSRT"
+#define SORT_VERSION 1
+#define SORT_PENDING_MIN 1024
+
+// Packed selections front-code paths: each entry stores how many leading
+// bytes it shares with the one before and the rest. Every PACK_RESTART
+// entries a block starts over with a full path, and a table of block
+// offsets at the end lets readers start at any block.
+#define PACK_MAGIC "FSELPAK"
+#define PACK_VERSION 1
+#define PACK_RESTART 16
+#define PACK_BUFFER_SIZE (1 << 20)
+
+// New lines of an add batch are collected into one large append
+#define APPEND_BUFFER_SIZE (1 << 20)
+
+// Parallel ingestion hands paths to resolver threads in fixed-size chunks
+#define INGEST_CHUNK 256
+#define INGEST_INFLIGHT 64
+#define MAX_DEFAULT_JOBS 8
+
+// Adds remember the resolved form of recently seen parent directories,
+// keyed by how the input spells them
+#define RESOLVE_CACHE_SLOTS 256
+
+// Recursive walk reads directories in large getdents64 batches
+#define WALK_DENTS_SIZE (64 * 1024)
+
+// Validation stats paths in batches; stat is I/O bound, so it gets more
+// threads than there are CPUs
+#define STAT_BATCH 4096
+#define STAT_JOBS_PER_CPU 4
+#define URING_ENTRIES 256
+
+// Sorting keeps at most this many bytes of paths in memory and spills
+// sorted runs to $TMPDIR beyond that; FSEL_SORT_MEMORY overrides it
+#define SORT_MEMORY_DEFAULT (64 << 20)
+#define SORT_MEMORY_MIN (1 << 20)
+#define SORT_MAX_RUNS 64
+
+// Plain listing gathers runs of active lines into one writev call
+#define LIST_IOV_MAX 1024
+
+// Exec mode leaves this much of ARG_MAX unused, as xargs does
+#define EXEC_ARG_HEADROOM 2048
+
+// File operations work through the selection in batches; the paths of a
+// finished batch leave the selection before the next one starts
+#define FILEOP_BATCH 1024
+#define COPY_BUFFER_SIZE (1 << 20)
+
+// Longest name of a named selection (-S)
+#define SELECTION_NAME_MAX 64
+
+// Daemon requests carry the caller's stdin, stdout, stderr and working
+// directory along with its arguments
+#define DAEMON_MAGIC 0x4653454c
+#define DAEMON_FDS 4
+#define DAEMON_MAX_REQUEST (1 << 20)
+#define DAEMON_DECLINED (-1000)
+// Most users and groups the daemon resolves up front for its requests
+#define DAEMON_PRELOAD_NAMES 4096
 
 // Command line flags
 #define FORCE_FLAG 0x01
@@ -43,10 +147,148 @@
 #define VALIDATE_FLAG 0x40
 #define LONG_FORMAT_FLAG 0x80
 #define DELETE_FLAG 0x100
+#define INVALID_ONLY_FLAG 0x200
+#define RANGE_FLAG 0x400
+#define HASH_BENCH_FLAG 0x800
+#define COMPACT_FLAG 0x1000
+#define DAEMON_FLAG 0x2000
+#define RECURSIVE_FLAG 0x4000
+#define PACK_FLAG 0x8000
+#define UNPACK_FLAG 0x10000
+#define UNDER_FLAG 0x20000
+#define COUNTS_FLAG 0x40000
+#define EXEC_FLAG 0x80000
+#define FILEOP_FLAG 0x100000
+#define SETOP_FLAG 0x200000
+
+// Long-only options
+#define INVALID_OPTION 1000
+#define RANGE_OPTION 1001
+#define HASH_BENCH_OPTION 1002
+#define COMPACT_OPTION 1003
+#define TIMEOUT_OPTION 1004
+#define DAEMON_OPTION 1005
+#define NAME_OPTION 1006
+#define TYPE_OPTION 1007
+#define MAXDEPTH_OPTION 1008
+#define PACK_OPTION 1009
+#define UNPACK_OPTION 1010
+#define UNDER_OPTION 1011
+#define COUNTS_OPTION 1012
+#define CP_OPTION 1013
+#define MV_OPTION 1014
+#define RM_OPTION 1015
+#define STATS_OPTION 1016
+#define UNION_OPTION 1017
+#define INTERSECT_OPTION 1018
+#define DIFF_OPTION 1019
 
 char lock_filename[PATH_MAX];
 char temp_filename[PATH_MAX];
 char index_filename[PATH_MAX];
+char free_filename[PATH_MAX];
+char lines_filename[PATH_MAX];
+char sort_filename[PATH_MAX];
+char pack_filename[PATH_MAX];
+char socket_filename[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+// Worker threads for path resolution, 0 picks a default from the CPU count
+long worker_count = 0;
+
+// Filters of the recursive walk: basename glob, entry type (a DT_ value,
+// 0 for any) and depth limit (negative for none)
+const char* walk_name = NULL;
+int walk_type = 0;
+long walk_max_depth = -1;
+
+// Seconds to wait for the selection lock, negative waits for good
+double lock_timeout = -1;
+
+// Memory cap for sorting the selection
+size_t sort_memory = SORT_MEMORY_DEFAULT;
+
+// Sorted listing keeps and uses the sort index unless FSEL_SORT_INDEX=0
+int use_sort_index = 1;
+
+// Hash function of the open index, as recorded in its header
+int hash_algo = HASH_MURMUR3;
+
+// Hash function for indexes created from now on, from FSEL_HASH
+int create_hash_algo = HASH_MURMUR3;
+
+// Window of active paths printed by --range, counted from zero
+uint64_t range_start = 0;
+uint64_t range_count = 0;
+
+// Shell command run by -x on batches of selected paths
+const char* exec_command = NULL;
+
+// Built-in file operation on the selection and its target directory
+enum fileop_kind { FILEOP_COPY, FILEOP_MOVE, FILEOP_REMOVE };
+int fileop = FILEOP_COPY;
+const char* fileop_dest = NULL;
+
+// Named selection (-S) the command works on, NULL for the default one
+const char* selection_name = NULL;
+
+// Set operation writing into the selection, with selection names as operands
+enum setop_kind { SETOP_UNION, SETOP_INTERSECT, SETOP_DIFF };
+int setop = SETOP_UNION;
+
+// Phases that --stats splits the time of a command into. The main thread
+// switches between them; worker threads only add to counters.
+enum stats_phase {
+    PHASE_OTHER,
+    PHASE_LOCK,
+    PHASE_OPEN,
+    PHASE_INPUT,
+    PHASE_RESOLVE,
+    PHASE_INDEX,
+    PHASE_SORT,
+    PHASE_OUTPUT,
+    PHASE_VALIDATE,
+    PHASE_COMPACT,
+    PHASE_COMMIT,
+    PHASE_COUNT
+};
+
+static const char* const stats_phase_names[PHASE_COUNT] = {
+    "other", "lock", "open", "input", "resolve", "index", "sort", "output", "validate", "compact", "commit",
+};
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+// Counters of one command for --stats (or FSEL_STATS). Counters are kept
+// even when nothing is reported; only phase timing depends on stats_format.
+struct stats {
+    int phase;
+    struct timespec wall_mark;
+    struct timespec cpu_mark;
+    double wall[PHASE_COUNT];
+    double cpu[PHASE_COUNT];
+    uint64_t index_lookups;
+    uint64_t index_probes;
+    uint64_t reuse_hits;
+    uint64_t reuse_misses;
+    uint64_t reuse_stale;
+    uint64_t realpath_calls;
+    uint64_t lstat_calls;
+    uint64_t stat_calls;
+    uint64_t resolve_cache_hits;
+    uint64_t resolve_cache_lookups;
+    uint64_t temp_appended;
+    uint64_t temp_rewritten;
+    uint64_t index_bytes;
+};
+
+struct stats stats;
+int stats_format = 0;
+
+// Subtree given to --under as "DIR/" ("/" for the root), so that its
+// paths are the ones starting with it plus DIR itself
+char under_prefix[PATH_MAX + 1];
+size_t under_prefix_len = 0;
 
 int is_active_line(const char* line) {
     return line != NULL && line[0] == '/';
@@ -61,842 +303,6263 @@ int is_zero_hash(const unsigned char* hash) {
     return 1;
 }
 
-void count_storage(int* active, int* tombstones) {
-    *active = 0;
-    *tombstones = 0;
-    if (access(temp_filename, F_OK) == -1) {
-        return;
+double timespec_diff(const struct timespec* end, const struct timespec* start) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Charge the time since the last switch to the current phase and move on
+// to phase. Returns the phase left, for switching back.
+int stats_phase(int phase) {
+    int prev = stats.phase;
+    if (!stats_format || phase == prev) {
+        return prev;
     }
-    FILE* temp_file = fopen(temp_filename, "r");
-    if (!temp_file) {
-        return;
+    struct timespec wall;
+    struct timespec cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    stats.wall[prev] += timespec_diff(&wall, &stats.wall_mark);
+    stats.cpu[prev] += timespec_diff(&cpu, &stats.cpu_mark);
+    stats.wall_mark = wall;
+    stats.cpu_mark = cpu;
+    stats.phase = phase;
+    return prev;
+}
+
+// strdup() that reports running out of memory; callers skip the string
+char* safe_strdup(const char* str) {
+    char* new_str = strdup(str);
+    if (!new_str) {
+        perror("Failed to allocate memory");
     }
-    char* line = NULL;
-    size_t len = 0;
-    while (getline(&line, &len, temp_file) != -1) {
-        if (is_active_line(line)) {
-            (*active)++;
-        } else if (len > 0) {
-            (*tombstones)++;
-        }
+    return new_str;
+}
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3_x64_128 with seed 0, written out little-endian
+void murmur3_hash(const char* data, size_t len, unsigned char* hash) {
+    const unsigned char* p = (const unsigned char*)data;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    size_t nblocks = len / 16;
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k1;
+        uint64_t k2;
+        memcpy(&k1, p + i * 16, 8);
+        memcpy(&k2, p + i * 16 + 8, 8);
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+    const unsigned char* tail = p + nblocks * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    switch (len & 15) {
+        case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+        case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+        case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+        case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+        case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+        case 10: k2 ^= (uint64_t)tail[9] << 8; /* fall through */
+        case 9:
+            k2 ^= (uint64_t)tail[8];
+            k2 *= c2;
+            k2 = rotl64(k2, 33);
+            k2 *= c1;
+            h2 ^= k2;
+            /* fall through */
+        case 8: k1 ^= (uint64_t)tail[7] << 56; /* fall through */
+        case 7: k1 ^= (uint64_t)tail[6] << 48; /* fall through */
+        case 6: k1 ^= (uint64_t)tail[5] << 40; /* fall through */
+        case 5: k1 ^= (uint64_t)tail[4] << 32; /* fall through */
+        case 4: k1 ^= (uint64_t)tail[3] << 24; /* fall through */
+        case 3: k1 ^= (uint64_t)tail[2] << 16; /* fall through */
+        case 2: k1 ^= (uint64_t)tail[1] << 8; /* fall through */
+        case 1:
+            k1 ^= (uint64_t)tail[0];
+            k1 *= c1;
+            k1 = rotl64(k1, 31);
+            k1 *= c2;
+            h1 ^= k1;
+    }
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    memcpy(hash, &h1, 8);
+    memcpy(hash + 8, &h2, 8);
+}
+
+void sha256_hash(const char* data, size_t len, unsigned char* hash) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)data, len, digest);
+    memcpy(hash, digest, HASH_SIZE);
+}
+
+void hash_path(int algo, const char* path, size_t len, unsigned char* hash) {
+    if (algo == HASH_SHA256) {
+        sha256_hash(path, len, hash);
+    } else {
+        murmur3_hash(path, len, hash);
     }
-    free(line);
-    fclose(temp_file);
 }
 
 void compute_hash(const char* path, unsigned char* hash) {
-    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-    const EVP_MD* md = EVP_sha256();
-    EVP_DigestInit_ex(ctx, md, NULL);
-    EVP_DigestUpdate(ctx, path, strlen(path));
-    EVP_DigestFinal_ex(ctx, hash, NULL);
-    EVP_MD_CTX_free(ctx);
-}
-
-int hash_exists(FILE* index_file, unsigned char* hash) {
-    rewind(index_file);
-    unsigned char buffer[HASH_SIZE];
-    while (fread(buffer, HASH_SIZE, 1, index_file)) {
-        if (is_zero_hash(buffer)) {
-            continue;
-        }
-        if (memcmp(buffer, hash, HASH_SIZE) == 0) {
-            return 1;
+    hash_path(hash_algo, path, strlen(path), hash);
+}
+
+struct free_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t spare;
+    uint64_t end;
+    uint64_t heads[FREE_MAX_SLOT + 1];
+};
+
+// Records are chained per slot length; links hold record number + 1
+struct free_slot {
+    uint64_t line;
+    uint64_t offset;
+    uint64_t next;
+};
+
+struct free_list {
+    int fd;
+    size_t map_size;
+    struct free_header* header;
+    struct free_slot* slots;
+};
+
+size_t free_map_size(uint64_t capacity) {
+    return sizeof(struct free_header) + capacity * sizeof(struct free_slot);
+}
+
+int free_map(struct free_list* fl, int fd, size_t size) {
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map free-list file");
+        return -1;
+    }
+    fl->fd = fd;
+    fl->map_size = size;
+    fl->header = map;
+    fl->slots = (struct free_slot*)((char*)map + sizeof(struct free_header));
+    return 0;
+}
+
+void free_close(struct free_list* fl) {
+    if (fl->header) {
+        munmap(fl->header, fl->map_size);
+    }
+    if (fl->fd >= 0) {
+        close(fl->fd);
+    }
+    fl->fd = -1;
+    fl->header = NULL;
+    fl->slots = NULL;
+}
+
+int free_push(struct free_list* fl, size_t slot_len, uint64_t line, off_t offset) {
+    if (slot_len == 0 || slot_len > FREE_MAX_SLOT) {
+        return 0;
+    }
+    struct free_header* h = fl->header;
+    uint64_t rec;
+    if (h->spare) {
+        rec = h->spare - 1;
+        h->spare = fl->slots[rec].next;
+    } else {
+        if (h->end == h->capacity) {
+            uint64_t capacity = h->capacity * 2;
+            size_t size = free_map_size(capacity);
+            if (ftruncate(fl->fd, (off_t)size) != 0) {
+                perror("Failed to grow free-list file");
+                return -1;
+            }
+            void* map = mremap(fl->header, fl->map_size, size, MREMAP_MAYMOVE);
+            if (map == MAP_FAILED) {
+                perror("Failed to map free-list file");
+                return -1;
+            }
+            fl->map_size = size;
+            fl->header = h = map;
+            fl->slots = (struct free_slot*)((char*)map + sizeof(struct free_header));
+            h->capacity = capacity;
         }
+        rec = h->end++;
     }
+    fl->slots[rec].line = line;
+    fl->slots[rec].offset = (uint64_t)offset;
+    fl->slots[rec].next = h->heads[slot_len];
+    h->heads[slot_len] = rec + 1;
+    h->count++;
     return 0;
 }
 
-int reuse_tombstone_slot(const char* abs_path, const unsigned char* hash) {
-    FILE* temp_file = fopen(temp_filename, "r+");
-    if (!temp_file) {
+// Take a tombstoned slot of exactly slot_len bytes off the list
+int free_pop(struct free_list* fl, size_t slot_len, uint64_t* line, off_t* offset) {
+    if (slot_len == 0 || slot_len > FREE_MAX_SLOT) {
         return 0;
     }
-    FILE* index_file = fopen(index_filename, "r+");
-    if (!index_file) {
-        fclose(temp_file);
+    struct free_header* h = fl->header;
+    if (!h->heads[slot_len]) {
         return 0;
     }
+    uint64_t rec = h->heads[slot_len] - 1;
+    h->heads[slot_len] = fl->slots[rec].next;
+    *line = fl->slots[rec].line;
+    *offset = (off_t)fl->slots[rec].offset;
+    fl->slots[rec].next = h->spare;
+    h->spare = rec + 1;
+    h->count--;
+    return 1;
+}
+
+int free_create(struct free_list* fl) {
+    int fd = open(free_filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("Failed to create free-list file");
+        return -1;
+    }
+    size_t size = free_map_size(FREE_MIN_CAPACITY);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        perror("Failed to size free-list file");
+        close(fd);
+        return -1;
+    }
+    if (free_map(fl, fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    memcpy(fl->header->magic, FREE_MAGIC, sizeof(FREE_MAGIC));
+    fl->header->version = FREE_VERSION;
+    fl->header->capacity = FREE_MIN_CAPACITY;
+    return 0;
+}
 
+// Collect every tombstone of the selection into a fresh free list
+int free_rebuild(struct free_list* fl) {
+    free_close(fl);
+    if (free_create(fl) != 0) {
+        return -1;
+    }
+    FILE* temp_file = fopen(temp_filename, "r");
+    if (!temp_file) {
+        return 0;
+    }
     char* line = NULL;
     size_t len = 0;
     ssize_t read;
     off_t offset = 0;
-    int line_index = 0;
-    size_t path_len = strlen(abs_path);
-
+    uint64_t line_index = 0;
+    int rc = 0;
     while ((read = getline(&line, &len, temp_file)) != -1) {
-        size_t line_len = (size_t)read;
-        if (!is_active_line(line)) {
-            if (path_len + 1 <= line_len) {
-                char* buf = malloc(line_len);
-                if (!buf) {
-                    perror("Failed to allocate memory");
-                    free(line);
-                    fclose(temp_file);
-                    fclose(index_file);
-                    return 0;
-                }
-                memcpy(buf, abs_path, path_len);
-                buf[path_len] = '\n';
-                if (line_len > path_len + 1) {
-                    memset(buf + path_len + 1, ' ', line_len - path_len - 1);
-                }
-                fseek(temp_file, offset, SEEK_SET);
-                if (fwrite(buf, 1, line_len, temp_file) != line_len) {
-                    perror("Failed to reuse tombstone slot");
-                    free(buf);
-                    free(line);
-                    fclose(temp_file);
-                    fclose(index_file);
-                    return 0;
-                }
-                free(buf);
-                fseek(index_file, (long)line_index * HASH_SIZE, SEEK_SET);
-                if (fwrite(hash, HASH_SIZE, 1, index_file) != 1) {
-                    perror("Failed to write hash for reused slot");
-                    free(line);
-                    fclose(temp_file);
-                    fclose(index_file);
-                    return 0;
-                }
-                free(line);
-                fclose(temp_file);
-                fclose(index_file);
-                return 1;
-            }
+        if (!is_active_line(line) && free_push(fl, (size_t)read, line_index, offset) != 0) {
+            rc = -1;
+            break;
         }
         offset += read;
         line_index++;
     }
     free(line);
     fclose(temp_file);
-    fclose(index_file);
-    return 0;
+    return rc;
 }
 
-int process_path(const char* path, FILE* temp_file, FILE* index_file) {
-    struct stat st;
-    if (stat(path, &st) == -1) {
-        fprintf(stderr, "Path does not exist: %s\n", path);
-        return 0;
-    }
-    char* abs_path = realpath(path, NULL);
-    if (!abs_path) {
-        fprintf(stderr, "Invalid path: %s\n", path);
-        return 0;
+int free_open(struct free_list* fl) {
+    fl->fd = -1;
+    fl->header = NULL;
+    fl->slots = NULL;
+    int fd = open(free_filename, O_RDWR);
+    if (fd == -1) {
+        return free_rebuild(fl);
     }
-    unsigned char hash[HASH_SIZE];
-    compute_hash(abs_path, hash);
-    if (hash_exists(index_file, hash)) {
-        free(abs_path);
-        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct free_header)) {
+        close(fd);
+        return free_rebuild(fl);
     }
-    if (reuse_tombstone_slot(abs_path, hash)) {
-        free(abs_path);
-        return 1;
+    if (free_map(fl, fd, (size_t)st.st_size) != 0) {
+        close(fd);
+        return -1;
     }
-    fprintf(temp_file, "%s\n", abs_path);
-    if (fwrite(hash, HASH_SIZE, 1, index_file) != 1) {
-        fprintf(stderr, "Failed to write hash for: %s\n", abs_path);
-        free(abs_path);
-        return 0;
+    struct free_header* h = fl->header;
+    if (memcmp(h->magic, FREE_MAGIC, sizeof(FREE_MAGIC)) != 0 || h->version != FREE_VERSION ||
+        free_map_size(h->capacity) != (size_t)st.st_size || h->end > h->capacity) {
+        return free_rebuild(fl);
     }
-    free(abs_path);
-    return 1;
+    return 0;
 }
 
-int lock_file_exists() {
-    return access(lock_filename, F_OK) == 0;
+struct lines_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t active;
+};
+
+struct line_entry {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t flags;
+};
+
+struct line_table {
+    int fd;
+    size_t map_size;
+    struct lines_header* header;
+    struct line_entry* entries;
+};
+
+size_t lines_map_size(uint64_t capacity) {
+    return sizeof(struct lines_header) + capacity * sizeof(struct line_entry);
 }
 
-// Lock for the user
-int create_lock_file(int force) {
-    if (force && lock_file_exists()) {
-        if (unlink(lock_filename) == -1) {
-            perror("Failed to remove lock file");
-            return -1;
-        }
-    }
-    int fd = open(lock_filename, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd == -1) {
-        if (errno == EEXIST) {
-            fprintf(stderr, "Error: Lock file exists\n");
-        } else {
-            perror("Failed to create lock file");
-        }
+int lines_map(struct line_table* lt, int fd, size_t size) {
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map line table");
         return -1;
     }
-    close(fd);
+    lt->fd = fd;
+    lt->map_size = size;
+    lt->header = map;
+    lt->entries = (struct line_entry*)((char*)map + sizeof(struct lines_header));
     return 0;
 }
 
-void remove_lock_file() {
-    unlink(lock_filename);
+void lines_close(struct line_table* lt) {
+    if (lt->header) {
+        munmap(lt->header, lt->map_size);
+    }
+    if (lt->fd >= 0) {
+        close(lt->fd);
+    }
+    lt->fd = -1;
+    lt->header = NULL;
+    lt->entries = NULL;
 }
 
-char* safe_strdup(const char* str) {
-    char* new_str = strdup(str);
-    if (!new_str) {
-        perror("Failed to allocate memory");
-        exit(EXIT_FAILURE);
+int lines_create(struct line_table* lt, const char* filename) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("Failed to create line table");
+        return -1;
     }
-    return new_str;
+    size_t size = lines_map_size(LINES_MIN_CAPACITY);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        perror("Failed to size line table");
+        close(fd);
+        return -1;
+    }
+    if (lines_map(lt, fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    memcpy(lt->header->magic, LINES_MAGIC, sizeof(LINES_MAGIC));
+    lt->header->version = LINES_VERSION;
+    lt->header->capacity = LINES_MIN_CAPACITY;
+    return 0;
 }
 
-int compare_strings(const void* a, const void* b) {
-    return strcmp(*(char**)a, *(char**)b);
+int lines_append(struct line_table* lt, uint64_t offset, size_t length, uint32_t flags) {
+    struct lines_header* h = lt->header;
+    if (h->count == h->capacity) {
+        uint64_t capacity = h->capacity * 2;
+        size_t size = lines_map_size(capacity);
+        if (ftruncate(lt->fd, (off_t)size) != 0) {
+            perror("Failed to grow line table");
+            return -1;
+        }
+        void* map = mremap(lt->header, lt->map_size, size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) {
+            perror("Failed to map line table");
+            return -1;
+        }
+        lt->map_size = size;
+        lt->header = h = map;
+        lt->entries = (struct line_entry*)((char*)map + sizeof(struct lines_header));
+        h->capacity = capacity;
+    }
+    struct line_entry* e = &lt->entries[h->count++];
+    e->offset = offset;
+    e->length = (uint32_t)length;
+    e->flags = flags;
+    if (flags & LINE_ACTIVE) {
+        h->active++;
+    }
+    return 0;
 }
 
-// Function to format time like ls -l
-void format_time(char* buffer, size_t size, time_t time_val) {
-    time_t now = time(NULL);
-    // If file is older than 6 months, show year instead of time
-    if (now - time_val > 180 * 24 * 60 * 60) {
-        strftime(buffer, size, "%b %d  %Y", localtime(&time_val));
-    } else {
-        strftime(buffer, size, "%b %d %H:%M", localtime(&time_val));
+// Record the offset and length of every line of the selection afresh
+int lines_rebuild(struct line_table* lt) {
+    lines_close(lt);
+    if (lines_create(lt, lines_filename) != 0) {
+        return -1;
+    }
+    FILE* temp_file = fopen(temp_filename, "r");
+    if (!temp_file) {
+        return 0;
+    }
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    uint64_t offset = 0;
+    int rc = 0;
+    while ((read = getline(&line, &len, temp_file)) != -1) {
+        if (lines_append(lt, offset, (size_t)read, is_active_line(line) ? LINE_ACTIVE : 0) != 0) {
+            rc = -1;
+            break;
+        }
+        offset += (uint64_t)read;
     }
+    free(line);
+    fclose(temp_file);
+    return rc;
 }
 
-// Function to print file info in ls -l format
-void print_file_info(const char* path) {
+// Open the table, rebuilding it unless it covers exactly the given lines
+int lines_open(struct line_table* lt, uint64_t lines) {
+    lt->fd = -1;
+    lt->header = NULL;
+    lt->entries = NULL;
+    int fd = open(lines_filename, O_RDWR);
+    if (fd == -1) {
+        return lines_rebuild(lt);
+    }
     struct stat st;
-    if (lstat(path, &st) == -1) {
-        printf("Could not stat %s\n", path);
-        return;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct lines_header)) {
+        close(fd);
+        return lines_rebuild(lt);
     }
-
-    // File type and permissions
-    char perms[11];
-    if (S_ISLNK(st.st_mode)) {
-        perms[0] = 'l';
-    } else if (S_ISDIR(st.st_mode)) {
-        perms[0] = 'd';
-    } else if (S_ISCHR(st.st_mode)) {
-        perms[0] = 'c';
-    } else if (S_ISBLK(st.st_mode)) {
-        perms[0] = 'b';
-    } else if (S_ISFIFO(st.st_mode)) {
-        perms[0] = 'p';
-    } else if (S_ISSOCK(st.st_mode)) {
-        perms[0] = 's';
-    } else {
-        perms[0] = '-';
+    if (lines_map(lt, fd, (size_t)st.st_size) != 0) {
+        close(fd);
+        return -1;
     }
-    perms[1] = (st.st_mode & S_IRUSR) ? 'r' : '-';
-    perms[2] = (st.st_mode & S_IWUSR) ? 'w' : '-';
-    perms[3] = (st.st_mode & S_IXUSR) ? 'x' : '-';
-    perms[4] = (st.st_mode & S_IRGRP) ? 'r' : '-';
-    perms[5] = (st.st_mode & S_IWGRP) ? 'w' : '-';
-    perms[6] = (st.st_mode & S_IXGRP) ? 'x' : '-';
-    perms[7] = (st.st_mode & S_IROTH) ? 'r' : '-';
-    perms[8] = (st.st_mode & S_IWOTH) ? 'w' : '-';
-    perms[9] = (st.st_mode & S_IXOTH) ? 'x' : '-';
-    perms[10] = '\0';
-
-    // Get user and group names
-    struct passwd* pwd = getpwuid(st.st_uid);
-    struct group* grp = getgrgid(st.st_gid);
-    char* user = pwd ? pwd->pw_name : "?";
-    char* group = grp ? grp->gr_name : "?";
-
-    // Format time
-    char time_str[20];
-    format_time(time_str, sizeof(time_str), st.st_mtime);
-
-    // Print in ls -l format with aligned columns
-    printf("%s %3ld %-8s %-8s %8ld %s %s", perms, (long)st.st_nlink, user, group, (long)st.st_size, time_str, path);
-
-    // For symlinks, show the target
-    if (S_ISLNK(st.st_mode)) {
-        char link_target[1024];
-        ssize_t len = readlink(path, link_target, sizeof(link_target) - 1);
-        if (len != -1) {
-            link_target[len] = '\0';
-            printf(" -> %s", link_target);
-        }
+    struct lines_header* h = lt->header;
+    if (memcmp(h->magic, LINES_MAGIC, sizeof(LINES_MAGIC)) != 0 || h->version != LINES_VERSION ||
+        lines_map_size(h->capacity) != (size_t)st.st_size || h->count != lines) {
+        return lines_rebuild(lt);
     }
-    printf("\n");
+    return 0;
 }
 
-// Add new path to selection
-int add_mode(int argc, char** argv, int flags) {
-    if (lock_file_exists() && !(flags & FORCE_FLAG)) {
-        fprintf(stderr, "Error: Lock file exists\n");
+// Map the table read-only for lookups outside the lock. Fails quietly when
+// the table does not describe a file of the given size, so callers can
+// fall back to reading the selection itself.
+int lines_load(struct line_table* lt, off_t temp_size) {
+    lt->fd = -1;
+    lt->header = NULL;
+    lt->entries = NULL;
+    int fd = open(lines_filename, O_RDONLY);
+    if (fd == -1) {
         return -1;
     }
-    if (create_lock_file(flags & FORCE_FLAG) != 0) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct lines_header)) {
+        close(fd);
         return -1;
     }
-
-    if (flags & REPLACE_FLAG) {
-        FILE* temp_file = fopen(temp_filename, "w");
-        if (!temp_file) {
-            perror("Failed to create temp file");
-            remove_lock_file();
-            return -1;
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    lt->fd = fd;
+    lt->map_size = (size_t)st.st_size;
+    lt->header = map;
+    lt->entries = (struct line_entry*)((char*)map + sizeof(struct lines_header));
+    struct lines_header* h = lt->header;
+    uint64_t end = 0;
+    if (memcmp(h->magic, LINES_MAGIC, sizeof(LINES_MAGIC)) == 0 && h->version == LINES_VERSION &&
+        lines_map_size(h->capacity) == (size_t)st.st_size && h->count <= h->capacity && h->active <= h->count) {
+        if (h->count > 0) {
+            end = lt->entries[h->count - 1].offset + lt->entries[h->count - 1].length;
         }
-        fclose(temp_file);
-        FILE* index_file = fopen(index_filename, "wb");
-        if (!index_file) {
-            perror("Failed to create index file");
-            remove_lock_file();
-            return -1;
+        if (end == (uint64_t)temp_size) {
+            return 0;
         }
-        fclose(index_file);
     }
+    lines_close(lt);
+    return -1;
+}
 
-    FILE* temp_file = fopen(temp_filename, "a");
-    if (!temp_file) {
-        perror("Failed to open temp file");
-        return -1;
-    }
-    FILE* index_file = fopen(index_filename, "a+");
-    if (!index_file) {
-        perror("Failed to open index file");
-        fclose(temp_file);
-        return -1;
+// Besides the table geometry the header carries live storage counters,
+// so summaries and compaction decisions never have to read the selection
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_size;
+    uint64_t bucket_count;
+    uint64_t used;
+    uint64_t deleted;
+    uint64_t lines;
+    uint64_t active;
+    uint64_t tombstones;
+    uint64_t tombstone_bytes;
+    uint64_t total_bytes;
+    uint32_t dirty;
+    uint32_t hash_algo;
+};
+
+// Empty buckets have line == 0, deleted ones keep the line but zero the hash
+struct index_bucket {
+    unsigned char hash[HASH_SIZE];
+    uint64_t line;
+};
+
+struct index {
+    int fd;
+    size_t map_size;
+    struct index_header* header;
+    struct index_bucket* buckets;
+};
+
+size_t index_map_size(uint64_t bucket_count) {
+    return sizeof(struct index_header) + bucket_count * sizeof(struct index_bucket);
+}
+
+uint64_t index_slot(const unsigned char* hash, uint64_t bucket_count) {
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    return h & (bucket_count - 1);
+}
+
+int index_map(struct index* idx, int fd, size_t size) {
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map index file");
+        return -1;
+    }
+    idx->fd = fd;
+    idx->map_size = size;
+    idx->header = map;
+    idx->buckets = (struct index_bucket*)((char*)map + sizeof(struct index_header));
+    return 0;
+}
+
+void index_close(struct index* idx) {
+    if (idx->header) {
+        munmap(idx->header, idx->map_size);
+    }
+    if (idx->fd >= 0) {
+        close(idx->fd);
+    }
+    idx->fd = -1;
+    idx->header = NULL;
+    idx->buckets = NULL;
+}
+
+// Create an empty table in filename, replacing whatever was there
+int index_create(struct index* idx, const char* filename, uint64_t bucket_count) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("Failed to create index file");
+        return -1;
+    }
+    size_t size = index_map_size(bucket_count);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        perror("Failed to size index file");
+        close(fd);
+        return -1;
+    }
+    if (index_map(idx, fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    memcpy(idx->header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    idx->header->version = INDEX_VERSION;
+    idx->header->hash_size = HASH_SIZE;
+    idx->header->hash_algo = (uint32_t)hash_algo;
+    idx->header->bucket_count = bucket_count;
+    return 0;
+}
+
+int stored_line_matches(int temp_fd, off_t offset, const char* key, size_t key_len) {
+    char buf[PATH_MAX + 1];
+    if (key_len + 1 > sizeof(buf) || pread(temp_fd, buf, key_len + 1, offset) != (ssize_t)(key_len + 1)) {
+        return 0;
+    }
+    return memcmp(buf, key, key_len) == 0 && buf[key_len] == '\n';
+}
+
+// A path looked up by its hash, to be confirmed against the stored line
+struct line_key {
+    const struct line_table* lt;
+    int temp_fd;
+    const char* key;
+    size_t key_len;
+};
+
+int line_key_matches(uint64_t line, void* arg) {
+    const struct line_key* k = arg;
+    if (line >= k->lt->header->count) {
+        return 0;
+    }
+    const struct line_entry* e = &k->lt->entries[line];
+    return e->flags & LINE_ACTIVE && e->length == k->key_len + 1 &&
+           stored_line_matches(k->temp_fd, (off_t)e->offset, k->key, k->key_len);
+}
+
+typedef int (*bucket_match_fn)(uint64_t line, void* arg);
+
+// Find the bucket of a key by its hash. Different paths may share a hash,
+// so a bucket only counts once match confirms the line it points at.
+struct index_bucket* index_probe(struct index* idx, const unsigned char* hash, bucket_match_fn match, void* arg) {
+    uint64_t mask = idx->header->bucket_count - 1;
+    uint64_t slot = index_slot(hash, idx->header->bucket_count);
+    stats.index_lookups++;
+    for (;;) {
+        struct index_bucket* b = &idx->buckets[slot];
+        stats.index_probes++;
+        if (b->line == 0) {
+            return NULL;
+        }
+        if (memcmp(b->hash, hash, HASH_SIZE) == 0 && match(b->line - 1, arg)) {
+            return b;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Insert into a table known to have room and not to contain the path
+void index_put(struct index* idx, const unsigned char* hash, uint64_t line) {
+    uint64_t mask = idx->header->bucket_count - 1;
+    uint64_t slot = index_slot(hash, idx->header->bucket_count);
+    stats.index_probes++;
+    while (idx->buckets[slot].line != 0) {
+        slot = (slot + 1) & mask;
+        stats.index_probes++;
+    }
+    memcpy(idx->buckets[slot].hash, hash, HASH_SIZE);
+    idx->buckets[slot].line = line + 1;
+    idx->header->used++;
+}
+
+uint64_t index_buckets_for(uint64_t entries) {
+    uint64_t count = INDEX_MIN_BUCKETS;
+    while (count / 2 < entries) {
+        count *= 2;
+    }
+    return count;
+}
+
+// Rehash live entries into a fresh table, dropping deleted buckets.
+// line_map, when given, translates old line numbers into new ones.
+int index_rehash(struct index* idx, uint64_t bucket_count, const uint64_t* line_map, uint64_t lines) {
+    char index_new[PATH_MAX];
+    int ret = snprintf(index_new, sizeof(index_new), "%s.new", index_filename);
+    if (ret < 0 || ret >= (int)sizeof(index_new)) {
+        fprintf(stderr, "Error: Path too long for index new file\n");
+        return -1;
+    }
+    struct index fresh = {-1, 0, NULL, NULL};
+    if (index_create(&fresh, index_new, bucket_count) != 0) {
+        return -1;
+    }
+    fresh.header->hash_algo = idx->header->hash_algo;
+    for (uint64_t i = 0; i < idx->header->bucket_count; i++) {
+        struct index_bucket* b = &idx->buckets[i];
+        if (b->line == 0 || is_zero_hash(b->hash)) {
+            continue;
+        }
+        uint64_t line = b->line - 1;
+        if (line_map) {
+            // Lines dropped by compaction take their stale hashes with them
+            if (line >= idx->header->lines || line_map[line] == UINT64_MAX) {
+                continue;
+            }
+            line = line_map[line];
+        }
+        index_put(&fresh, b->hash, line);
+    }
+    fresh.header->lines = lines;
+    fresh.header->active = idx->header->active;
+    fresh.header->tombstones = idx->header->tombstones;
+    fresh.header->tombstone_bytes = idx->header->tombstone_bytes;
+    fresh.header->total_bytes = idx->header->total_bytes;
+    fresh.header->dirty = idx->header->dirty;
+    if (rename(index_new, index_filename) != 0) {
+        perror("Failed to rename index file");
+        index_close(&fresh);
+        unlink(index_new);
+        return -1;
+    }
+    index_close(idx);
+    *idx = fresh;
+    return 0;
+}
+
+int index_insert(struct index* idx, const unsigned char* hash, uint64_t line) {
+    struct index_header* h = idx->header;
+    // Keep the load factor (including deleted buckets) under 70%
+    if ((h->used + h->deleted + 1) * 10 > h->bucket_count * 7) {
+        if (index_rehash(idx, index_buckets_for(h->used + 1), NULL, h->lines) != 0) {
+            return -1;
+        }
+    }
+    index_put(idx, hash, line);
+    return 0;
+}
+
+// Mark the bucket of a removed path as a tombstone: zero hash, line kept
+// so that probe sequences running through it are not cut short
+void index_tombstone(struct index* idx, struct index_bucket* b) {
+    memset(b->hash, 0, HASH_SIZE);
+    idx->header->used--;
+    idx->header->deleted++;
+}
+
+// Mark the storage as being modified; an index left dirty by an
+// interrupted run is rebuilt from the selection on the next open
+void index_begin(struct index* idx) {
+    idx->header->dirty = 1;
+}
+
+void index_commit(struct index* idx) {
+    idx->header->dirty = 0;
+}
+
+// Build the table, counters, free list and line table from scratch out of
+// the stored paths
+int index_rebuild(struct index* idx) {
+    index_close(idx);
+    struct index fresh = {-1, 0, NULL, NULL};
+    if (index_create(&fresh, index_filename, INDEX_MIN_BUCKETS) != 0) {
+        return -1;
+    }
+    struct free_list fl = {-1, 0, NULL, NULL};
+    if (free_create(&fl) != 0) {
+        index_close(&fresh);
+        return -1;
+    }
+    struct line_table lt = {-1, 0, NULL, NULL};
+    if (lines_create(&lt, lines_filename) != 0) {
+        index_close(&fresh);
+        free_close(&fl);
+        return -1;
+    }
+    int rc = 0;
+    FILE* temp_file = fopen(temp_filename, "r");
+    if (temp_file) {
+        struct index_header* h = fresh.header;
+        char* line = NULL;
+        size_t len = 0;
+        ssize_t read;
+        unsigned char hash[HASH_SIZE];
+        while ((read = getline(&line, &len, temp_file)) != -1) {
+            size_t line_len = (size_t)read;
+            int active = is_active_line(line);
+            if (lines_append(&lt, h->total_bytes, line_len, active ? LINE_ACTIVE : 0) != 0) {
+                rc = -1;
+                break;
+            }
+            if (active) {
+                size_t key_len = strcspn(line, "\n");
+                line[key_len] = '\0';
+                compute_hash(line, hash);
+                struct line_key key = {&lt, fileno(temp_file), line, key_len};
+                if (!index_probe(&fresh, hash, line_key_matches, &key) && index_insert(&fresh, hash, h->lines) != 0) {
+                    rc = -1;
+                    break;
+                }
+                h = fresh.header;
+                h->active++;
+            } else {
+                if (free_push(&fl, line_len, h->lines, (off_t)h->total_bytes) != 0) {
+                    rc = -1;
+                    break;
+                }
+                h->tombstones++;
+                h->tombstone_bytes += line_len;
+            }
+            h->lines++;
+            h->total_bytes += line_len;
+        }
+        free(line);
+        fclose(temp_file);
+    }
+    free_close(&fl);
+    lines_close(&lt);
+    if (rc != 0) {
+        index_close(&fresh);
+        return -1;
+    }
+    *idx = fresh;
+    return 0;
+}
+
+int index_open(struct index* idx) {
+    idx->fd = -1;
+    idx->header = NULL;
+    idx->buckets = NULL;
+    int fd = open(index_filename, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        perror("Failed to open index file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to stat index file");
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size >= sizeof(struct index_header)) {
+        if (index_map(idx, fd, (size_t)st.st_size) != 0) {
+            close(fd);
+            return -1;
+        }
+        struct index_header* h = idx->header;
+        uint64_t count = h->bucket_count;
+        int known = memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && h->version == INDEX_VERSION &&
+                    h->hash_size == HASH_SIZE && (h->hash_algo == HASH_MURMUR3 || h->hash_algo == HASH_SHA256);
+        // An existing index keeps its hash function, also when rebuilt
+        hash_algo = known ? (int)h->hash_algo : create_hash_algo;
+        if (known && count >= INDEX_MIN_BUCKETS && (count & (count - 1)) == 0 &&
+            index_map_size(count) == (size_t)st.st_size) {
+            // An interrupted writer or a selection changed behind our back
+            // leaves counters that no longer describe the storage
+            struct stat temp_st;
+            uint64_t temp_size = stat(temp_filename, &temp_st) == 0 ? (uint64_t)temp_st.st_size : 0;
+            if (!h->dirty && h->total_bytes == temp_size) {
+                return 0;
+            }
+        }
+        // Older index, foreign data or stale counters: rebuild from the
+        // selection
+        return index_rebuild(idx);
+    }
+    close(fd);
+    hash_algo = create_hash_algo;
+    return index_rebuild(idx);
+}
+
+struct sort_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // Index counters as of the last update, anything else means stale
+    uint64_t lines;
+    uint64_t active;
+    uint64_t total_bytes;
+    uint64_t main_count;
+    uint64_t pending_count;
+};
+
+// Stored paths addressed by line number through the line table
+struct sort_source {
+    const char* map;
+    size_t size;
+    const struct line_entry* entries;
+    uint64_t count;
+};
+
+int sort_source_open(struct sort_source* src, int temp_fd, const struct line_table* lt) {
+    src->map = NULL;
+    src->size = 0;
+    src->entries = lt->entries;
+    src->count = lt->header->count;
+    struct stat st;
+    if (fstat(temp_fd, &st) != 0) {
+        perror("Failed to stat temp file");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, temp_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map temp file");
+        return -1;
+    }
+    src->map = map;
+    src->size = (size_t)st.st_size;
+    return 0;
+}
+
+void sort_source_close(struct sort_source* src) {
+    if (src->map) {
+        munmap((void*)src->map, src->size);
+    }
+    src->map = NULL;
+}
+
+// Same order as strcmp on the stored lines, newline included
+int compare_source_lines(const void* a, const void* b, void* arg) {
+    const struct sort_source* src = arg;
+    const struct line_entry* ea = &src->entries[*(const uint64_t*)a];
+    const struct line_entry* eb = &src->entries[*(const uint64_t*)b];
+    size_t n = ea->length < eb->length ? ea->length : eb->length;
+    int r = memcmp(src->map + ea->offset, src->map + eb->offset, n);
+    if (r != 0) {
+        return r;
+    }
+    return (ea->length > eb->length) - (ea->length < eb->length);
+}
+
+int sort_is_current(const struct sort_header* sh, const struct index_header* ih) {
+    return memcmp(sh->magic, SORT_MAGIC, sizeof(SORT_MAGIC)) == 0 && sh->version == SORT_VERSION &&
+           sh->lines == ih->lines && sh->active == ih->active && sh->total_bytes == ih->total_bytes;
+}
+
+void sort_stamp(struct sort_header* sh, const struct index_header* ih) {
+    sh->lines = ih->lines;
+    sh->active = ih->active;
+    sh->total_bytes = ih->total_bytes;
+}
+
+uint8_t* line_bitset(uint64_t count) {
+    uint8_t* bits = calloc(count / 8 + 1, 1);
+    if (!bits) {
+        perror("Failed to allocate memory");
+    }
+    return bits;
+}
+
+uint64_t* sort_alloc(uint64_t count) {
+    uint64_t* lines = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!lines) {
+        perror("Failed to allocate memory");
+    }
+    return lines;
+}
+
+uint64_t sort_merge_lines(const uint64_t* a, uint64_t na, const uint64_t* b, uint64_t nb, uint64_t* out,
+                          const struct sort_source* src) {
+    uint64_t i = 0;
+    uint64_t j = 0;
+    uint64_t n = 0;
+    while (i < na && j < nb) {
+        if (compare_source_lines(&a[i], &b[j], (void*)src) <= 0) {
+            out[n++] = a[i++];
+        } else {
+            out[n++] = b[j++];
+        }
+    }
+    while (i < na) {
+        out[n++] = a[i++];
+    }
+    while (j < nb) {
+        out[n++] = b[j++];
+    }
+    return n;
+}
+
+// Write a whole sort index next to the current one and move it into place.
+// Readers under the shared lock may build one at the same time, so each
+// writes its own file.
+int sort_write(const uint64_t* main_lines, uint64_t main_count, const uint64_t* pending, uint64_t pending_count,
+               const struct index_header* ih) {
+    char sort_new[PATH_MAX];
+    int ret = snprintf(sort_new, sizeof(sort_new), "%s.XXXXXX", sort_filename);
+    if (ret < 0 || ret >= (int)sizeof(sort_new)) {
+        fprintf(stderr, "Error: Path too long for sort index new file\n");
+        return -1;
+    }
+    int fd = mkstemp(sort_new);
+    FILE* out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!out) {
+        perror("Failed to create sort index");
+        if (fd != -1) {
+            close(fd);
+            unlink(sort_new);
+        }
+        return -1;
+    }
+    struct sort_header sh;
+    memset(&sh, 0, sizeof(sh));
+    memcpy(sh.magic, SORT_MAGIC, sizeof(SORT_MAGIC));
+    sh.version = SORT_VERSION;
+    sort_stamp(&sh, ih);
+    sh.main_count = main_count;
+    sh.pending_count = pending_count;
+    fwrite(&sh, sizeof(sh), 1, out);
+    fwrite(main_lines, sizeof(uint64_t), main_count, out);
+    fwrite(pending, sizeof(uint64_t), pending_count, out);
+    if (ferror(out) | fclose(out)) {
+        perror("Failed to write sort index");
+        unlink(sort_new);
+        return -1;
+    }
+    if (rename(sort_new, sort_filename) != 0) {
+        perror("Failed to rename sort index");
+        unlink(sort_new);
+        return -1;
+    }
+    return 0;
+}
+
+// Sort every active line from scratch
+int sort_build(const struct sort_source* src, const struct index_header* ih) {
+    uint64_t* order = sort_alloc(src->count);
+    if (!order) {
+        return -1;
+    }
+    uint64_t count = 0;
+    for (uint64_t line = 0; line < src->count; line++) {
+        if (src->entries[line].flags & LINE_ACTIVE) {
+            order[count++] = line;
+        }
+    }
+    qsort_r(order, count, sizeof(uint64_t), compare_source_lines, (void*)src);
+    int rc = sort_write(order, count, NULL, 0, ih);
+    free(order);
+    return rc;
+}
+
+// Read both parts of a sort index into one array, main part first
+uint64_t* sort_read(int fd, const struct sort_header* sh) {
+    uint64_t count = sh->main_count + sh->pending_count;
+    uint64_t* lines = sort_alloc(count);
+    size_t want = count * sizeof(uint64_t);
+    if (!lines || pread(fd, lines, want, sizeof(struct sort_header)) != (ssize_t)want) {
+        free(lines);
+        return NULL;
+    }
+    return lines;
+}
+
+// Carry the sort index over a compaction. The line map keeps the order of
+// lines, so both parts stay sorted once dead and superseded lines are gone.
+int sort_remap(int fd, const uint64_t* line_map, uint64_t old_lines, const struct index_header* ih) {
+    struct sort_header sh;
+    if (pread(fd, &sh, sizeof(sh), 0) != (ssize_t)sizeof(sh)) {
+        return -1;
+    }
+    uint64_t* lines = sort_read(fd, &sh);
+    if (!lines) {
+        return -1;
+    }
+    uint64_t* pending = lines + sh.main_count;
+    uint8_t* in_pending = line_bitset(old_lines);
+    if (!in_pending) {
+        free(lines);
+        return -1;
+    }
+    for (uint64_t i = 0; i < sh.pending_count; i++) {
+        if (pending[i] < old_lines) {
+            in_pending[pending[i] / 8] |= 1 << (pending[i] % 8);
+        }
+    }
+    uint64_t main_count = 0;
+    for (uint64_t i = 0; i < sh.main_count; i++) {
+        uint64_t line = lines[i];
+        if (line < old_lines && !(in_pending[line / 8] & (1 << (line % 8))) && line_map[line] != UINT64_MAX) {
+            lines[main_count++] = line_map[line];
+        }
+    }
+    uint64_t* new_pending = lines + main_count;
+    uint64_t pending_count = 0;
+    for (uint64_t i = 0; i < sh.pending_count; i++) {
+        uint64_t line = pending[i];
+        if (line < old_lines && line_map[line] != UINT64_MAX) {
+            new_pending[pending_count++] = line_map[line];
+        }
+    }
+    free(in_pending);
+    int rc = sort_write(lines, main_count, new_pending, pending_count, ih);
+    free(lines);
+    return rc;
+}
+
+// Check that a free-list record still points at a whole tombstone line
+int is_tombstone_slot(int fd, off_t offset, size_t slot_len) {
+    char buf[FREE_MAX_SLOT + 1];
+    off_t start = offset > 0 ? offset - 1 : 0;
+    size_t want = slot_len + (size_t)(offset - start);
+    if (pread(fd, buf, want, start) != (ssize_t)want) {
+        return 0;
+    }
+    if (offset > 0 && buf[0] != '\n') {
+        return 0;
+    }
+    const char* slot = buf + (offset - start);
+    if (slot[slot_len - 1] != '\n') {
+        return 0;
+    }
+    for (size_t i = 0; i + 1 < slot_len; i++) {
+        if (slot[i] != ' ') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Everything a batch of changes writes to, opened once per invocation
+struct store {
+    FILE* temp_file;
+    int temp_fd;
+    struct index idx;
+    struct free_list fl;
+    struct line_table lines;
+    char* append_buffer;
+    // End of what has reached the file, later lines may still be buffered
+    uint64_t flushed;
+    // Path being looked up
+    struct line_key key;
+    // Sort index, when there is a current one, and the lines added to it
+    int sort_fd;
+    uint64_t* sorted_adds;
+    size_t sorted_add_count;
+    size_t sorted_add_size;
+};
+
+struct pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t restart;
+    uint64_t count;
+    // Size of the selection as plain lines
+    uint64_t plain_bytes;
+    uint64_t blocks_offset;
+    uint64_t block_count;
+};
+
+// Decoding state behind the stream returned by pack_fopen
+struct pack_reader {
+    FILE* in;
+    struct pack_header header;
+    uint64_t next;
+    char* line;
+    size_t line_len;
+    size_t line_size;
+    size_t out_pos;
+    size_t out_len;
+};
+
+int pack_put_varint(FILE* out, uint64_t value) {
+    while (value >= 0x80) {
+        if (putc((int)(value & 0x7f) | 0x80, out) == EOF) {
+            return -1;
+        }
+        value >>= 7;
+    }
+    return putc((int)value, out) == EOF ? -1 : 0;
+}
+
+int pack_get_varint(FILE* in, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(in);
+        if (c == EOF) {
+            return -1;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Decode the next entry into the reader's line, ending it with a newline
+int pack_decode(struct pack_reader* r) {
+    uint64_t shared, suffix;
+    if (pack_get_varint(r->in, &shared) != 0 || pack_get_varint(r->in, &suffix) != 0 ||
+        shared > r->line_len || (r->next % r->header.restart == 0 && shared != 0) || suffix > SIZE_MAX / 2) {
+        return -1;
+    }
+    size_t len = (size_t)shared + (size_t)suffix;
+    if (len + 1 > r->line_size) {
+        size_t size = r->line_size ? r->line_size : 256;
+        while (size < len + 1) {
+            size *= 2;
+        }
+        char* line = realloc(r->line, size);
+        if (!line) {
+            return -1;
+        }
+        r->line = line;
+        r->line_size = size;
+    }
+    if (fread(r->line + shared, 1, (size_t)suffix, r->in) != (size_t)suffix) {
+        return -1;
+    }
+    r->line[len] = '\n';
+    r->line_len = len;
+    r->out_pos = 0;
+    r->out_len = len + 1;
+    r->next++;
+    return 0;
+}
+
+ssize_t pack_read(void* cookie, char* buf, size_t size) {
+    struct pack_reader* r = cookie;
+    size_t done = 0;
+    while (done < size) {
+        if (r->out_pos == r->out_len) {
+            if (r->next == r->header.count) {
+                break;
+            }
+            if (pack_decode(r) != 0) {
+                errno = EIO;
+                return -1;
+            }
+        }
+        size_t n = r->out_len - r->out_pos;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(buf + done, r->line + r->out_pos, n);
+        r->out_pos += n;
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+int pack_close_reader(void* cookie) {
+    struct pack_reader* r = cookie;
+    fclose(r->in);
+    free(r->line);
+    free(r);
+    return 0;
+}
+
+// Open the packed selection as a stream of plain lines starting at entry
+// first. Returns NULL with errno ENOENT when there is no packed selection.
+FILE* pack_fopen(uint64_t first) {
+    FILE* in = fopen(pack_filename, "r");
+    if (!in) {
+        return NULL;
+    }
+    struct pack_reader* r = calloc(1, sizeof(struct pack_reader));
+    if (!r) {
+        perror("Failed to allocate memory");
+        fclose(in);
+        return NULL;
+    }
+    r->in = in;
+    struct pack_header* h = &r->header;
+    if (fread(h, sizeof(*h), 1, in) != 1 || memcmp(h->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 ||
+        h->version != PACK_VERSION || h->restart == 0 || h->block_count != (h->count + h->restart - 1) / h->restart) {
+        fprintf(stderr, "Error: Packed selection is damaged\n");
+        fclose(in);
+        free(r);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (first > h->count) {
+        first = h->count;
+    }
+    uint64_t block = first / h->restart;
+    uint64_t offset = sizeof(*h);
+    if (block < h->block_count &&
+        (fseeko(in, (off_t)(h->blocks_offset + block * sizeof(uint64_t)), SEEK_SET) != 0 ||
+         fread(&offset, sizeof(offset), 1, in) != 1)) {
+        fprintf(stderr, "Error: Packed selection is damaged\n");
+        fclose(in);
+        free(r);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (fseeko(in, (off_t)offset, SEEK_SET) != 0) {
+        perror("Failed to read packed selection");
+        fclose(in);
+        free(r);
+        return NULL;
+    }
+    r->next = block < h->block_count ? block * h->restart : h->count;
+    while (r->next < first) {
+        if (pack_decode(r) != 0) {
+            fprintf(stderr, "Error: Packed selection is damaged\n");
+            pack_close_reader(r);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    r->out_pos = r->out_len = 0;
+    cookie_io_functions_t io = {pack_read, NULL, NULL, pack_close_reader};
+    FILE* stream = fopencookie(r, "r", io);
+    if (!stream) {
+        perror("Failed to open packed selection");
+        pack_close_reader(r);
+    }
+    return stream;
+}
+
+// Write the active lines of the selection to a new packed file. Returns
+// its size, or -1.
+off_t pack_write(FILE* temp_file, uint64_t* count) {
+    char pack_new[PATH_MAX];
+    int ret = snprintf(pack_new, sizeof(pack_new), "%s.XXXXXX", pack_filename);
+    if (ret < 0 || ret >= (int)sizeof(pack_new)) {
+        fprintf(stderr, "Error: Path too long for packed selection\n");
+        return -1;
+    }
+    int fd = mkstemp(pack_new);
+    FILE* out = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (!out) {
+        perror("Failed to create packed selection");
+        if (fd != -1) {
+            close(fd);
+            unlink(pack_new);
+        }
+        return -1;
+    }
+    struct pack_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    h.version = PACK_VERSION;
+    h.restart = PACK_RESTART;
+    uint64_t* blocks = NULL;
+    size_t block_size = 0;
+    char* prev = NULL;
+    size_t prev_len = 0;
+    size_t prev_size = 0;
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int rc = fwrite(&h, sizeof(h), 1, out) == 1 ? 0 : -1;
+    while (rc == 0 && (read = getline(&line, &len, temp_file)) != -1) {
+        if (!is_active_line(line)) {
+            continue;
+        }
+        size_t line_len = (size_t)read - (line[read - 1] == '\n');
+        size_t shared = 0;
+        if (h.count % PACK_RESTART == 0) {
+            if (h.block_count == block_size) {
+                block_size = block_size ? block_size * 2 : 1024;
+                uint64_t* grown = realloc(blocks, block_size * sizeof(uint64_t));
+                if (!grown) {
+                    perror("Failed to allocate memory");
+                    rc = -1;
+                    break;
+                }
+                blocks = grown;
+            }
+            blocks[h.block_count++] = (uint64_t)ftello(out);
+        } else {
+            while (shared < prev_len && shared < line_len && prev[shared] == line[shared]) {
+                shared++;
+            }
+        }
+        if (pack_put_varint(out, shared) != 0 || pack_put_varint(out, line_len - shared) != 0 ||
+            fwrite(line + shared, 1, line_len - shared, out) != line_len - shared) {
+            rc = -1;
+            break;
+        }
+        // Swap buffers so the line just written becomes the previous one
+        char* tmp = prev;
+        size_t tmp_size = prev_size;
+        prev = line;
+        prev_size = len;
+        prev_len = line_len;
+        line = tmp;
+        len = tmp_size;
+        h.count++;
+        h.plain_bytes += line_len + 1;
+    }
+    free(line);
+    free(prev);
+    h.blocks_offset = (uint64_t)ftello(out);
+    if (rc == 0 && h.block_count > 0 && fwrite(blocks, sizeof(uint64_t), h.block_count, out) != h.block_count) {
+        rc = -1;
+    }
+    free(blocks);
+    off_t size = ftello(out);
+    if (rc == 0 && (fseeko(out, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, out) != 1)) {
+        rc = -1;
+    }
+    if (fclose(out) != 0 || rc != 0 || rename(pack_new, pack_filename) != 0) {
+        perror("Failed to write packed selection");
+        unlink(pack_new);
+        return -1;
+    }
+    *count = h.count;
+    return size;
+}
+
+int write_all(int fd, const void* buf, size_t len);
+
+// A packed selection is an archive: listings read it as it is, changes are
+// refused until --unpack turns it back into plain storage
+int refuse_packed(void) {
+    if (access(pack_filename, F_OK) == -1) {
+        return 0;
+    }
+    fprintf(stderr, "Error: Selection is packed, run fsel --unpack to change it\n");
+    return -1;
+}
+
+// Turn a packed selection back into plain storage, so it can be changed.
+// The index, free list and line table are rebuilt from it on open.
+int pack_expand(void) {
+    if (access(pack_filename, F_OK) == -1) {
+        return 0;
+    }
+    FILE* in = pack_fopen(0);
+    if (!in) {
+        return -1;
+    }
+    char temp_new[PATH_MAX];
+    int ret = snprintf(temp_new, sizeof(temp_new), "%s.XXXXXX", temp_filename);
+    if (ret < 0 || ret >= (int)sizeof(temp_new)) {
+        fprintf(stderr, "Error: Path too long for temp new file\n");
+        fclose(in);
+        return -1;
+    }
+    int fd = mkstemp(temp_new);
+    char* buffer = malloc(PACK_BUFFER_SIZE);
+    if (fd == -1 || !buffer) {
+        perror("Failed to unpack selection");
+        if (fd != -1) {
+            close(fd);
+            unlink(temp_new);
+        }
+        free(buffer);
+        fclose(in);
+        return -1;
+    }
+    int rc = 0;
+    size_t n;
+    while ((n = fread(buffer, 1, PACK_BUFFER_SIZE, in)) > 0) {
+        if (write_all(fd, buffer, n) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (ferror(in)) {
+        rc = -1;
+    }
+    free(buffer);
+    fclose(in);
+    if (close(fd) != 0 || rc != 0 || rename(temp_new, temp_filename) != 0) {
+        perror("Failed to unpack selection");
+        unlink(temp_new);
+        return -1;
+    }
+    unlink(index_filename);
+    unlink(free_filename);
+    unlink(lines_filename);
+    unlink(sort_filename);
+    unlink(pack_filename);
+    return 0;
+}
+
+// Open the selection for a batch of changes. With preload the whole
+// index is faulted in up front, so a large batch probes it from memory.
+int store_open_files(struct store* st, int preload) {
+    st->temp_file = NULL;
+    st->append_buffer = NULL;
+    if (refuse_packed() != 0) {
+        return -1;
+    }
+    st->temp_fd = open(temp_filename, O_RDWR | O_CREAT, 0600);
+    if (st->temp_fd == -1) {
+        perror("Failed to open temp file");
+        return -1;
+    }
+    int append_fd = open(temp_filename, O_WRONLY | O_APPEND);
+    if (append_fd == -1 || !(st->temp_file = fdopen(append_fd, "a"))) {
+        perror("Failed to open temp file");
+        if (append_fd != -1) {
+            close(append_fd);
+        }
+        close(st->temp_fd);
+        return -1;
+    }
+    st->append_buffer = malloc(APPEND_BUFFER_SIZE);
+    if (st->append_buffer) {
+        setvbuf(st->temp_file, st->append_buffer, _IOFBF, APPEND_BUFFER_SIZE);
+    }
+    if (index_open(&st->idx) != 0) {
+        fclose(st->temp_file);
+        close(st->temp_fd);
+        free(st->append_buffer);
+        return -1;
+    }
+    if (free_open(&st->fl) != 0) {
+        index_close(&st->idx);
+        fclose(st->temp_file);
+        close(st->temp_fd);
+        free(st->append_buffer);
+        return -1;
+    }
+    if (lines_open(&st->lines, st->idx.header->lines) != 0) {
+        free_close(&st->fl);
+        index_close(&st->idx);
+        fclose(st->temp_file);
+        close(st->temp_fd);
+        free(st->append_buffer);
+        return -1;
+    }
+    st->flushed = st->idx.header->total_bytes;
+    st->sorted_adds = NULL;
+    st->sorted_add_count = 0;
+    st->sorted_add_size = 0;
+    st->sort_fd = open(sort_filename, O_RDWR);
+    if (st->sort_fd != -1) {
+        struct sort_header sh;
+        if (pread(st->sort_fd, &sh, sizeof(sh), 0) != (ssize_t)sizeof(sh) || !sort_is_current(&sh, st->idx.header)) {
+            // Out of date; the next sorted listing builds it again
+            close(st->sort_fd);
+            st->sort_fd = -1;
+            unlink(sort_filename);
+        }
+    }
+    if (preload) {
+        madvise(st->idx.header, st->idx.map_size, MADV_WILLNEED);
+    }
+    index_begin(&st->idx);
+    return 0;
+}
+
+int store_open(struct store* st, int preload) {
+    int prev = stats_phase(PHASE_OPEN);
+    int rc = store_open_files(st, preload);
+    stats_phase(prev);
+    return rc;
+}
+
+void store_close_read(struct store* st) {
+    close(st->temp_fd);
+    index_close(&st->idx);
+    lines_close(&st->lines);
+}
+
+// Open the selection for lookups only, under a shared lock: nothing is
+// written, so its index must already be clean and describe the storage.
+// Returns 1 when it does not and the selection needs a store_open first.
+int store_open_read(struct store* st) {
+    memset(st, 0, sizeof(*st));
+    st->idx.fd = -1;
+    st->lines.fd = -1;
+    st->sort_fd = -1;
+    if (refuse_packed() != 0) {
+        st->temp_fd = -1;
+        return -1;
+    }
+    st->temp_fd = open(temp_filename, O_RDONLY | O_CLOEXEC);
+    struct stat temp_st;
+    if (st->temp_fd == -1 || fstat(st->temp_fd, &temp_st) != 0) {
+        perror("Failed to open temp file");
+        if (st->temp_fd != -1) {
+            close(st->temp_fd);
+        }
+        return -1;
+    }
+    int fd = open(index_filename, O_RDONLY | O_CLOEXEC);
+    struct stat st_idx;
+    void* map = MAP_FAILED;
+    if (fd != -1 && fstat(fd, &st_idx) == 0 && (size_t)st_idx.st_size >= sizeof(struct index_header)) {
+        map = mmap(NULL, (size_t)st_idx.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        if (fd != -1) {
+            close(fd);
+        }
+        close(st->temp_fd);
+        return 1;
+    }
+    st->idx.fd = fd;
+    st->idx.map_size = (size_t)st_idx.st_size;
+    st->idx.header = map;
+    st->idx.buckets = (struct index_bucket*)((char*)map + sizeof(struct index_header));
+    struct index_header* h = st->idx.header;
+    uint64_t count = h->bucket_count;
+    if (memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h->version != INDEX_VERSION ||
+        h->hash_size != HASH_SIZE || (h->hash_algo != HASH_MURMUR3 && h->hash_algo != HASH_SHA256) ||
+        count < INDEX_MIN_BUCKETS || (count & (count - 1)) != 0 || index_map_size(count) != st->idx.map_size ||
+        h->dirty || h->total_bytes != (uint64_t)temp_st.st_size ||
+        lines_load(&st->lines, temp_st.st_size) != 0 || st->lines.header->count != h->lines) {
+        store_close_read(st);
+        return 1;
+    }
+    st->flushed = h->total_bytes;
+    return 0;
+}
+
+void store_note_sorted(struct store* st, uint64_t line) {
+    if (st->sort_fd == -1) {
+        return;
+    }
+    if (st->sorted_add_count == st->sorted_add_size) {
+        size_t size = st->sorted_add_size ? st->sorted_add_size * 2 : 256;
+        uint64_t* adds = realloc(st->sorted_adds, size * sizeof(uint64_t));
+        if (!adds) {
+            // Drop the sort index instead, sorted listing rebuilds it
+            perror("Failed to allocate memory");
+            unlink(sort_filename);
+            close(st->sort_fd);
+            st->sort_fd = -1;
+            return;
+        }
+        st->sorted_adds = adds;
+        st->sorted_add_size = size;
+    }
+    st->sorted_adds[st->sorted_add_count++] = line;
+}
+
+// Bring the sort index up to date with a committed batch. New lines are
+// merged into the pending part, which drops lines deleted since or reused
+// by this batch; past its limit it is folded into the main part.
+int sort_update(struct store* st) {
+    struct sort_header sh;
+    if (pread(st->sort_fd, &sh, sizeof(sh), 0) != (ssize_t)sizeof(sh)) {
+        return -1;
+    }
+    struct sort_source src;
+    if (sort_source_open(&src, st->temp_fd, &st->lines) != 0) {
+        return -1;
+    }
+    uint64_t* adds = st->sorted_adds;
+    uint64_t add_count = st->sorted_add_count;
+    qsort_r(adds, add_count, sizeof(uint64_t), compare_source_lines, &src);
+
+    uint64_t* pending = sort_alloc(sh.pending_count);
+    size_t want = sh.pending_count * sizeof(uint64_t);
+    off_t pending_offset = (off_t)(sizeof(sh) + sh.main_count * sizeof(uint64_t));
+    uint8_t* seen = pending ? line_bitset(src.count) : NULL;
+    if (!seen || pread(st->sort_fd, pending, want, pending_offset) != (ssize_t)want) {
+        free(pending);
+        free(seen);
+        sort_source_close(&src);
+        return -1;
+    }
+    for (uint64_t i = 0; i < add_count; i++) {
+        seen[adds[i] / 8] |= 1 << (adds[i] % 8);
+    }
+    uint64_t kept = 0;
+    for (uint64_t i = 0; i < sh.pending_count; i++) {
+        uint64_t line = pending[i];
+        if (line < src.count && src.entries[line].flags & LINE_ACTIVE && !(seen[line / 8] & (1 << (line % 8)))) {
+            pending[kept++] = line;
+        }
+    }
+    uint64_t* merged = sort_alloc(kept + add_count);
+    if (!merged) {
+        free(pending);
+        free(seen);
+        sort_source_close(&src);
+        return -1;
+    }
+    uint64_t merged_count = sort_merge_lines(pending, kept, adds, add_count, merged, &src);
+    free(pending);
+
+    int rc = 0;
+    uint64_t limit = sh.main_count / 16 > SORT_PENDING_MIN ? sh.main_count / 16 : SORT_PENDING_MIN;
+    if (merged_count > limit) {
+        uint64_t* main_lines = sort_read(st->sort_fd, &sh);
+        if (!main_lines) {
+            rc = -1;
+        } else {
+            memset(seen, 0, src.count / 8 + 1);
+            for (uint64_t i = 0; i < merged_count; i++) {
+                seen[merged[i] / 8] |= 1 << (merged[i] % 8);
+            }
+            uint64_t main_kept = 0;
+            for (uint64_t i = 0; i < sh.main_count; i++) {
+                uint64_t line = main_lines[i];
+                if (line < src.count && src.entries[line].flags & LINE_ACTIVE && !(seen[line / 8] & (1 << (line % 8)))) {
+                    main_lines[main_kept++] = line;
+                }
+            }
+            uint64_t* folded = sort_alloc(main_kept + merged_count);
+            if (!folded) {
+                rc = -1;
+            } else {
+                uint64_t folded_count = sort_merge_lines(main_lines, main_kept, merged, merged_count, folded, &src);
+                rc = sort_write(folded, folded_count, NULL, 0, st->idx.header);
+                free(folded);
+            }
+            free(main_lines);
+        }
+    } else {
+        size_t size = merged_count * sizeof(uint64_t);
+        sort_stamp(&sh, st->idx.header);
+        sh.pending_count = merged_count;
+        if (pwrite(st->sort_fd, merged, size, pending_offset) != (ssize_t)size ||
+            ftruncate(st->sort_fd, pending_offset + (off_t)size) != 0 ||
+            pwrite(st->sort_fd, &sh, sizeof(sh), 0) != (ssize_t)sizeof(sh)) {
+            rc = -1;
+        }
+    }
+    free(merged);
+    free(seen);
+    sort_source_close(&src);
+    return rc;
+}
+
+// Flush the batch and commit the counters once everything hit the file.
+// Without commit the index stays dirty and is rebuilt on the next open.
+int store_close(struct store* st, int commit) {
+    int prev = stats_phase(PHASE_COMMIT);
+    int rc = 0;
+    stats.index_bytes = index_map_size(st->idx.header->bucket_count);
+    if (fclose(st->temp_file) == 0) {
+        if (commit) {
+            index_commit(&st->idx);
+            if (st->sort_fd != -1 && sort_update(st) != 0) {
+                // Not worth failing the batch over, sorted listing rebuilds it
+                unlink(sort_filename);
+            }
+        }
+    } else {
+        perror("Failed to write temp file");
+        rc = -1;
+    }
+    if (st->sort_fd != -1) {
+        close(st->sort_fd);
+    }
+    free(st->sorted_adds);
+    free(st->append_buffer);
+    close(st->temp_fd);
+    index_close(&st->idx);
+    free_close(&st->fl);
+    lines_close(&st->lines);
+    stats_phase(prev);
+    return rc;
+}
+
+// Only exact-length slots are reused: padding a longer one would need an
+// extra line and shift the line numbers kept in the index
+int reuse_tombstone_slot(struct store* st, const char* abs_path, size_t path_len, const unsigned char* hash) {
+    size_t slot_len = path_len + 1;
+    uint64_t line_index;
+    off_t offset;
+    if (slot_len > FREE_MAX_SLOT || !st->fl.header->heads[slot_len]) {
+        stats.reuse_misses++;
+        return 0;
+    }
+    while (free_pop(&st->fl, slot_len, &line_index, &offset)) {
+        // Records of lines trimmed off the end may point past the file or
+        // into lines appended since
+        struct line_entry* e = line_index < st->lines.header->count ? &st->lines.entries[line_index] : NULL;
+        if (!e || e->offset != (uint64_t)offset || e->length != slot_len || e->flags & LINE_ACTIVE ||
+            !is_tombstone_slot(st->temp_fd, offset, slot_len)) {
+            stats.reuse_stale++;
+            continue;
+        }
+        char buf[FREE_MAX_SLOT];
+        memcpy(buf, abs_path, path_len);
+        buf[path_len] = '\n';
+        if (pwrite(st->temp_fd, buf, slot_len, offset) != (ssize_t)slot_len) {
+            perror("Failed to reuse tombstone slot");
+            return 0;
+        }
+        if (index_insert(&st->idx, hash, line_index) != 0) {
+            fprintf(stderr, "Failed to write hash for reused slot\n");
+            return 0;
+        }
+        e->flags |= LINE_ACTIVE;
+        st->lines.header->active++;
+        store_note_sorted(st, line_index);
+        st->idx.header->active++;
+        st->idx.header->tombstones--;
+        st->idx.header->tombstone_bytes -= slot_len;
+        stats.reuse_hits++;
+        stats.temp_rewritten += slot_len;
+        return 1;
+    }
+    stats.reuse_misses++;
+    return 0;
+}
+
+// Resolved parent directories of one resolving thread. A slot is picked
+// by hashing the parent as spelled in the input and overwritten on a miss.
+struct resolve_cache {
+    char* raw[RESOLVE_CACHE_SLOTS];
+    char* real[RESOLVE_CACHE_SLOTS];
+    size_t real_len[RESOLVE_CACHE_SLOTS];
+    uint64_t hits;
+    uint64_t lookups;
+    uint64_t realpath_calls;
+    uint64_t lstat_calls;
+};
+
+void resolve_cache_init(struct resolve_cache* c) {
+    memset(c, 0, sizeof(*c));
+}
+
+// Free the cache and add its counts to the totals
+void resolve_cache_free(struct resolve_cache* c) {
+    for (size_t i = 0; i < RESOLVE_CACHE_SLOTS; i++) {
+        free(c->raw[i]);
+        free(c->real[i]);
+    }
+    __atomic_add_fetch(&stats.resolve_cache_hits, c->hits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.resolve_cache_lookups, c->lookups, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.realpath_calls, c->realpath_calls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.lstat_calls, c->lstat_calls, __ATOMIC_RELAXED);
+}
+
+char* cache_realpath(struct resolve_cache* c, const char* path) {
+    c->realpath_calls++;
+    return realpath(path, NULL);
+}
+
+// realpath() that resolves the parent directory once per cache slot and
+// then checks only the last component with lstat. Anything the shortcut
+// cannot decide the same way realpath would (".", "..", trailing slashes,
+// symlinks, missing paths) goes to realpath itself.
+char* resolve_cached(struct resolve_cache* c, const char* path) {
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return cache_realpath(c, path);
+    }
+    char parent[PATH_MAX];
+    size_t parent_len = slash ? (size_t)(slash - path) : 1;
+    if (parent_len >= sizeof(parent)) {
+        return cache_realpath(c, path);
+    }
+    if (!slash) {
+        parent[0] = '.';
+    } else if (parent_len == 0) {
+        parent[0] = '/';
+        parent_len = 1;
+    } else {
+        memcpy(parent, path, parent_len);
+    }
+    parent[parent_len] = '\0';
+
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < parent_len; i++) {
+        h = (h ^ (unsigned char)parent[i]) * 1099511628211ULL;
+    }
+    size_t slot = h % RESOLVE_CACHE_SLOTS;
+    c->lookups++;
+    if (c->raw[slot] && strcmp(c->raw[slot], parent) == 0) {
+        c->hits++;
+    } else {
+        char* real = cache_realpath(c, parent);
+        if (!real) {
+            return cache_realpath(c, path);
+        }
+        free(c->raw[slot]);
+        free(c->real[slot]);
+        c->raw[slot] = safe_strdup(parent);
+        c->real[slot] = real;
+        c->real_len[slot] = strlen(real);
+    }
+
+    size_t real_len = c->real_len[slot];
+    size_t name_len = strlen(name);
+    // The root resolves to "/", which already ends in the separator
+    size_t base = real_len == 1 ? 0 : real_len;
+    if (base + 1 + name_len >= PATH_MAX) {
+        return cache_realpath(c, path);
+    }
+    char* abs_path = malloc(base + 1 + name_len + 1);
+    if (!abs_path) {
+        return NULL;
+    }
+    memcpy(abs_path, c->real[slot], base);
+    abs_path[base] = '/';
+    memcpy(abs_path + base + 1, name, name_len + 1);
+    struct stat st;
+    c->lstat_calls++;
+    if (lstat(abs_path, &st) != 0 || S_ISLNK(st.st_mode)) {
+        free(abs_path);
+        return cache_realpath(c, path);
+    }
+    return abs_path;
+}
+
+// Canonicalize a path and hash it. Returns NULL with errno set when the
+// path cannot be resolved.
+char* resolve_path(const char* path, size_t* path_len, unsigned char* hash, struct resolve_cache* cache) {
+    char* abs_path;
+    if (cache) {
+        abs_path = resolve_cached(cache, path);
+    } else {
+        __atomic_add_fetch(&stats.realpath_calls, 1, __ATOMIC_RELAXED);
+        abs_path = realpath(path, NULL);
+    }
+    if (!abs_path) {
+        return NULL;
+    }
+    *path_len = strlen(abs_path);
+    compute_hash(abs_path, hash);
+    return abs_path;
+}
+
+void report_unresolved(const char* path, int err) {
+    if (err == ENOENT || err == ENOTDIR) {
+        fprintf(stderr, "Path does not exist: %s\n", path);
+    } else {
+        fprintf(stderr, "Invalid path: %s\n", path);
+    }
+}
+
+int store_key_matches(uint64_t line, void* arg) {
+    struct store* st = arg;
+    const struct line_entry* e = line < st->lines.header->count ? &st->lines.entries[line] : NULL;
+    // Lines of this batch may still sit in the append buffer
+    if (e && e->offset + e->length > st->flushed) {
+        fflush(st->temp_file);
+        st->flushed = st->idx.header->total_bytes;
+    }
+    return line_key_matches(line, &st->key);
+}
+
+// Find the bucket of a stored path, NULL when it is not in the selection
+struct index_bucket* store_find(struct store* st, const char* path, size_t path_len, const unsigned char* hash) {
+    st->key = (struct line_key){&st->lines, st->temp_fd, path, path_len};
+    return index_probe(&st->idx, hash, store_key_matches, st);
+}
+
+// Dedupe and store one resolved path; paths already in the selection or
+// seen earlier in the same batch are dropped by the index lookup
+int store_path(struct store* st, const char* abs_path, size_t path_len, const unsigned char* hash) {
+    if (store_find(st, abs_path, path_len, hash)) {
+        return 0;
+    }
+    if (reuse_tombstone_slot(st, abs_path, path_len, hash)) {
+        return 1;
+    }
+    struct index_header* h = st->idx.header;
+    if (index_insert(&st->idx, hash, h->lines) != 0) {
+        fprintf(stderr, "Failed to write hash for: %s\n", abs_path);
+        return 0;
+    }
+    h = st->idx.header;
+    if (lines_append(&st->lines, h->total_bytes, path_len + 1, LINE_ACTIVE) != 0) {
+        return 0;
+    }
+    fwrite(abs_path, 1, path_len, st->temp_file);
+    fputc('\n', st->temp_file);
+    stats.temp_appended += path_len + 1;
+    store_note_sorted(st, h->lines);
+    h->lines++;
+    h->active++;
+    h->total_bytes += path_len + 1;
+    return 1;
+}
+
+int process_path(const char* path, struct store* st, struct resolve_cache* cache) {
+    size_t path_len;
+    unsigned char hash[HASH_SIZE];
+    int prev = stats_phase(PHASE_RESOLVE);
+    char* abs_path = resolve_path(path, &path_len, hash, cache);
+    if (!abs_path) {
+        report_unresolved(path, errno);
+        stats_phase(prev);
+        return 0;
+    }
+    stats_phase(PHASE_INDEX);
+    int added = store_path(st, abs_path, path_len, hash);
+    free(abs_path);
+    stats_phase(prev);
+    return added;
+}
+
+struct ingest_item {
+    char* path;
+    char* abs_path;
+    size_t path_len;
+    int error;
+    unsigned char hash[HASH_SIZE];
+};
+
+struct ingest_chunk {
+    size_t count;
+    int resolved;
+    struct ingest_chunk* next_work;
+    struct ingest_item items[INGEST_CHUNK];
+};
+
+// Reader -> resolver pool -> ordered writer. Chunks sit in the ring in
+// input order; resolvers pick them off the work list in any order and
+// the writer retires them strictly by sequence number.
+struct ingest {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t chunk_done;
+    pthread_cond_t space_free;
+    struct ingest_chunk* ring[INGEST_INFLIGHT];
+    struct ingest_chunk* work_head;
+    struct ingest_chunk* work_tail;
+    uint64_t queued;
+    uint64_t written;
+    int eof;
+    // Set when paths were dropped for lack of memory
+    int failed;
+    int argc;
+    char** argv;
+    int has_input;
+};
+
+struct ingest_chunk* ingest_chunk_new(void) {
+    struct ingest_chunk* chunk = malloc(sizeof(struct ingest_chunk));
+    if (!chunk) {
+        perror("Failed to allocate memory");
+        return NULL;
+    }
+    chunk->count = 0;
+    chunk->resolved = 0;
+    chunk->next_work = NULL;
+    return chunk;
+}
+
+void ingest_submit(struct ingest* in, struct ingest_chunk* chunk) {
+    pthread_mutex_lock(&in->lock);
+    while (in->queued - in->written >= INGEST_INFLIGHT) {
+        pthread_cond_wait(&in->space_free, &in->lock);
+    }
+    in->ring[in->queued % INGEST_INFLIGHT] = chunk;
+    in->queued++;
+    if (in->work_tail) {
+        in->work_tail->next_work = chunk;
+    } else {
+        in->work_head = chunk;
+    }
+    in->work_tail = chunk;
+    pthread_cond_signal(&in->work_ready);
+    pthread_mutex_unlock(&in->lock);
+}
+
+// Chunks are allocated on the first path that goes into them
+struct ingest_chunk* ingest_push(struct ingest* in, struct ingest_chunk* chunk, const char* path) {
+    if (!chunk && !(chunk = ingest_chunk_new())) {
+        in->failed = 1;
+        return NULL;
+    }
+    chunk->items[chunk->count].path = safe_strdup(path);
+    if (!chunk->items[chunk->count].path) {
+        in->failed = 1;
+        return chunk;
+    }
+    chunk->count++;
+    if (chunk->count == INGEST_CHUNK) {
+        ingest_submit(in, chunk);
+        return NULL;
+    }
+    return chunk;
+}
+
+void* ingest_reader(void* arg) {
+    struct ingest* in = arg;
+    struct ingest_chunk* chunk = NULL;
+    for (int i = 0; i < in->argc; i++) {
+        glob_t glob_result;
+        if (glob(in->argv[i], GLOB_TILDE | GLOB_MARK, NULL, &glob_result) == 0) {
+            for (size_t j = 0; j < glob_result.gl_pathc; j++) {
+                chunk = ingest_push(in, chunk, glob_result.gl_pathv[j]);
+            }
+            globfree(&glob_result);
+        }
+    }
+    if (in->has_input) {
+        char* line = NULL;
+        size_t len = 0;
+        ssize_t read;
+        while ((read = getline(&line, &len, stdin)) != -1) {
+            if (read > 0 && line[read - 1] == '\n') {
+                line[read - 1] = '\0';
+            }
+            chunk = ingest_push(in, chunk, line);
+        }
+        free(line);
+    }
+    if (chunk && chunk->count > 0) {
+        ingest_submit(in, chunk);
+    } else {
+        free(chunk);
+    }
+    pthread_mutex_lock(&in->lock);
+    in->eof = 1;
+    pthread_cond_broadcast(&in->work_ready);
+    pthread_cond_broadcast(&in->chunk_done);
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+void* ingest_worker(void* arg) {
+    struct ingest* in = arg;
+    // Without a cache every path goes to realpath
+    struct resolve_cache* cache = malloc(sizeof(struct resolve_cache));
+    if (cache) {
+        resolve_cache_init(cache);
+    }
+    for (;;) {
+        pthread_mutex_lock(&in->lock);
+        while (!in->work_head && !in->eof) {
+            pthread_cond_wait(&in->work_ready, &in->lock);
+        }
+        struct ingest_chunk* chunk = in->work_head;
+        if (!chunk) {
+            pthread_mutex_unlock(&in->lock);
+            if (cache) {
+                resolve_cache_free(cache);
+                free(cache);
+            }
+            return NULL;
+        }
+        in->work_head = chunk->next_work;
+        if (!in->work_head) {
+            in->work_tail = NULL;
+        }
+        pthread_mutex_unlock(&in->lock);
+
+        for (size_t i = 0; i < chunk->count; i++) {
+            struct ingest_item* item = &chunk->items[i];
+            item->abs_path = resolve_path(item->path, &item->path_len, item->hash, cache);
+            item->error = item->abs_path ? 0 : errno;
+        }
+
+        pthread_mutex_lock(&in->lock);
+        chunk->resolved = 1;
+        pthread_cond_broadcast(&in->chunk_done);
+        pthread_mutex_unlock(&in->lock);
+    }
+}
+
+// Add paths from arguments and stdin using a pool of resolver threads.
+// Returns the number of paths added, in the same order as the serial path,
+// or -1 when paths were dropped or the threads could not start.
+int ingest_paths(struct store* st, int argc, char** argv, int has_input, long jobs) {
+    struct ingest in;
+    memset(&in, 0, sizeof(in));
+    pthread_mutex_init(&in.lock, NULL);
+    pthread_cond_init(&in.work_ready, NULL);
+    pthread_cond_init(&in.chunk_done, NULL);
+    pthread_cond_init(&in.space_free, NULL);
+    in.argc = argc;
+    in.argv = argv;
+    in.has_input = has_input;
+
+    pthread_t reader;
+    pthread_t* workers = malloc((size_t)jobs * sizeof(pthread_t));
+    long started = 0;
+    while (workers && started < jobs && pthread_create(&workers[started], NULL, ingest_worker, &in) == 0) {
+        started++;
+    }
+    if (started == 0 || pthread_create(&reader, NULL, ingest_reader, &in) != 0) {
+        perror(started == 0 ? "Failed to start worker threads" : "Failed to start reader thread");
+        pthread_mutex_lock(&in.lock);
+        in.eof = 1;
+        pthread_cond_broadcast(&in.work_ready);
+        pthread_mutex_unlock(&in.lock);
+        for (long i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+        pthread_mutex_destroy(&in.lock);
+        pthread_cond_destroy(&in.work_ready);
+        pthread_cond_destroy(&in.chunk_done);
+        pthread_cond_destroy(&in.space_free);
+        return -1;
+    }
+
+    // The store waits on resolving workers, then stores their chunk
+    int count = 0;
+    int prev = stats_phase(PHASE_RESOLVE);
+    for (;;) {
+        stats_phase(PHASE_RESOLVE);
+        pthread_mutex_lock(&in.lock);
+        struct ingest_chunk* chunk = NULL;
+        while (in.written < in.queued || !in.eof) {
+            chunk = in.written < in.queued ? in.ring[in.written % INGEST_INFLIGHT] : NULL;
+            if (chunk && chunk->resolved) {
+                break;
+            }
+            chunk = NULL;
+            pthread_cond_wait(&in.chunk_done, &in.lock);
+        }
+        pthread_mutex_unlock(&in.lock);
+        if (!chunk) {
+            break;
+        }
+
+        stats_phase(PHASE_INDEX);
+        for (size_t i = 0; i < chunk->count; i++) {
+            struct ingest_item* item = &chunk->items[i];
+            if (item->abs_path) {
+                count += store_path(st, item->abs_path, item->path_len, item->hash);
+                free(item->abs_path);
+            } else {
+                report_unresolved(item->path, item->error);
+            }
+            free(item->path);
+        }
+        free(chunk);
+
+        pthread_mutex_lock(&in.lock);
+        in.ring[in.written % INGEST_INFLIGHT] = NULL;
+        in.written++;
+        pthread_cond_signal(&in.space_free);
+        pthread_mutex_unlock(&in.lock);
+    }
+
+    stats_phase(prev);
+    pthread_join(reader, NULL);
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&in.lock);
+    pthread_cond_destroy(&in.work_ready);
+    pthread_cond_destroy(&in.chunk_done);
+    pthread_cond_destroy(&in.space_free);
+    return in.failed ? -1 : count;
+}
+
+long default_worker_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus < MAX_DEFAULT_JOBS ? cpus : MAX_DEFAULT_JOBS;
+}
+
+struct parallel_job {
+    size_t count;
+    size_t next;
+    void (*fn)(size_t, void*);
+    void* arg;
+};
+
+void* parallel_worker(void* arg) {
+    struct parallel_job* job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        job->fn(i, job->arg);
+    }
+    return NULL;
+}
+
+// Call fn(i, arg) for every i below count on up to jobs threads,
+// the calling thread included
+void parallel_for(size_t count, long jobs, void (*fn)(size_t, void*), void* arg) {
+    struct parallel_job job = {count, 0, fn, arg};
+    long extra = jobs - 1;
+    if (count < 2) {
+        extra = 0;
+    } else if ((size_t)extra >= count) {
+        extra = (long)count - 1;
+    }
+    pthread_t* threads = extra > 0 ? malloc((size_t)extra * sizeof(pthread_t)) : NULL;
+    long started = 0;
+    while (threads && started < extra && pthread_create(&threads[started], NULL, parallel_worker, &job) == 0) {
+        started++;
+    }
+    parallel_worker(&job);
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Recursive walk for -R. Directories are tasks on per-thread deques: each
+// thread works depth-first from the top of its own deque and idle threads
+// steal from the bottom of the others. Entry paths are built from their
+// directory's path, so only roots and symlinks go through realpath.
+// Subdirectories are opened with openat from their parent, which stays
+// open until the last of them has been opened.
+struct walk_dir {
+    int fd;
+    long refs;
+};
+
+struct walk_task {
+    char* path;
+    size_t len;
+    long depth;
+    // Directory the task is opened from, NULL for roots, and the offset
+    // of the task's name in path
+    struct walk_dir* parent;
+    size_t name_off;
+};
+
+void walk_dir_put(struct walk_dir* dir) {
+    if (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_task* tasks;
+    size_t head;
+    size_t tail;
+    size_t size;
+};
+
+struct walker {
+    struct walk_deque* deques;
+    long jobs;
+    long next_id;
+    // Directories queued or being read; the walk is over at zero
+    long pending;
+    long idle;
+    long finished;
+    // Set when entries were dropped for lack of memory
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t out_ready;
+    pthread_cond_t out_space;
+    struct ingest_chunk* out_head;
+    struct ingest_chunk* out_tail;
+    size_t out_count;
+};
+
+// Count a directory as walked, waking the idle threads after the last one
+void walk_task_done(struct walker* w) {
+    if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_broadcast(&w->work_ready);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+// Queue a directory. The task takes over a reference to parent.
+void walk_push(struct walker* w, long id, char* path, size_t len, long depth, struct walk_dir* parent,
+               size_t name_off) {
+    struct walk_deque* d = &w->deques[id];
+    __atomic_add_fetch(&w->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->size) {
+        // Slide the live part down before growing
+        size_t live = d->tail - d->head;
+        if (d->head > 0 && live < d->size / 2) {
+            memmove(d->tasks, d->tasks + d->head, live * sizeof(struct walk_task));
+        } else {
+            size_t size = d->size ? d->size * 2 : 64;
+            struct walk_task* tasks = malloc(size * sizeof(struct walk_task));
+            if (!tasks) {
+                perror("Failed to allocate memory");
+                pthread_mutex_unlock(&d->lock);
+                __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+                free(path);
+                walk_dir_put(parent);
+                walk_task_done(w);
+                return;
+            }
+            memcpy(tasks, d->tasks + d->head, live * sizeof(struct walk_task));
+            free(d->tasks);
+            d->tasks = tasks;
+            d->size = size;
+        }
+        d->head = 0;
+        d->tail = live;
+    }
+    d->tasks[d->tail++] = (struct walk_task){path, len, depth, parent, name_off};
+    pthread_mutex_unlock(&d->lock);
+    if (__atomic_load_n(&w->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_broadcast(&w->work_ready);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+// Own deque from the top, then the others from the bottom
+int walk_take(struct walker* w, long id, struct walk_task* task) {
+    for (long k = 0; k < w->jobs; k++) {
+        struct walk_deque* d = &w->deques[(id + k) % w->jobs];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) {
+            *task = k == 0 ? d->tasks[--d->tail] : d->tasks[d->head++];
+            pthread_mutex_unlock(&d->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    return 0;
+}
+
+void walk_submit(struct walker* w, struct ingest_chunk* chunk) {
+    pthread_mutex_lock(&w->lock);
+    while (w->out_count >= INGEST_INFLIGHT) {
+        pthread_cond_wait(&w->out_space, &w->lock);
+    }
+    if (w->out_tail) {
+        w->out_tail->next_work = chunk;
+    } else {
+        w->out_head = chunk;
+    }
+    w->out_tail = chunk;
+    w->out_count++;
+    pthread_cond_signal(&w->out_ready);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int walk_matches(const char* name, int type, long depth) {
+    if (walk_max_depth >= 0 && depth > walk_max_depth) {
+        return 0;
+    }
+    if (walk_type && type != walk_type) {
+        return 0;
+    }
+    return !walk_name || fnmatch(walk_name, name, 0) == 0;
+}
+
+// Queue one walked entry for the writer. Symlinks are resolved like any
+// added path; everything else is canonical by construction.
+struct ingest_chunk* walk_emit(struct walker* w, struct ingest_chunk* chunk, const char* path, size_t len, int type) {
+    if (!chunk && !(chunk = ingest_chunk_new())) {
+        __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct ingest_item* item = &chunk->items[chunk->count];
+    item->path = NULL;
+    item->error = 0;
+    if (type == DT_LNK) {
+        item->abs_path = resolve_path(path, &item->path_len, item->hash, NULL);
+        if (!item->abs_path) {
+            item->error = errno;
+            item->path = safe_strdup(path);
+        }
+    } else {
+        item->abs_path = safe_strdup(path);
+        item->path_len = len;
+        if (item->abs_path) {
+            compute_hash(item->abs_path, item->hash);
+        }
+    }
+    if (!item->abs_path && !item->path) {
+        __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+        return chunk;
+    }
+    chunk->count++;
+    if (chunk->count == INGEST_CHUNK) {
+        walk_submit(w, chunk);
+        chunk = NULL;
+    }
+    return chunk;
+}
+
+struct ingest_chunk* walk_directory(struct walker* w, long id, struct walk_task* task, char* dents,
+                                    struct ingest_chunk* chunk) {
+    // Relative to the parent, no component can turn into a symlink between
+    // reading the parent and opening the task
+    int open_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int fd = task->parent ? openat(task->parent->fd, task->path + task->name_off, open_flags)
+                          : open(task->path, open_flags);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to read directory %s: %s\n", task->path, strerror(errno));
+        return chunk;
+    }
+    char path[PATH_MAX];
+    size_t base = task->len;
+    memcpy(path, task->path, base);
+    if (base > 0 && path[base - 1] != '/') {
+        path[base++] = '/';
+    }
+    // Shared with the subdirectory tasks once there is one
+    struct walk_dir* self = NULL;
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, dents, WALK_DENTS_SIZE)) > 0) {
+        for (long pos = 0; pos < nread;) {
+            struct dirent64* ent = (struct dirent64*)(dents + pos);
+            pos += ent->d_reclen;
+            const char* name = ent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            size_t name_len = strlen(name);
+            if (base + name_len >= sizeof(path)) {
+                fprintf(stderr, "Path too long: %s/%s\n", task->path, name);
+                continue;
+            }
+            int type = ent->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                __atomic_add_fetch(&stats.lstat_calls, 1, __ATOMIC_RELAXED);
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            memcpy(path + base, name, name_len + 1);
+            long depth = task->depth + 1;
+            if (walk_matches(name, type, depth)) {
+                chunk = walk_emit(w, chunk, path, base + name_len, type);
+            }
+            if (type == DT_DIR && (walk_max_depth < 0 || depth < walk_max_depth)) {
+                if (!self && (self = malloc(sizeof(struct walk_dir)))) {
+                    self->fd = fd;
+                    self->refs = 1;
+                } else if (!self) {
+                    perror("Failed to allocate memory");
+                }
+                char* dir = self ? safe_strdup(path) : NULL;
+                if (dir) {
+                    __atomic_add_fetch(&self->refs, 1, __ATOMIC_RELAXED);
+                    walk_push(w, id, dir, base + name_len, depth, self, base);
+                } else {
+                    __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    if (nread < 0) {
+        fprintf(stderr, "Failed to read directory %s: %s\n", task->path, strerror(errno));
+    }
+    if (self) {
+        walk_dir_put(self);
+    } else {
+        close(fd);
+    }
+    return chunk;
+}
+
+void* walk_worker(void* arg) {
+    struct walker* w = arg;
+    long id = __atomic_fetch_add(&w->next_id, 1, __ATOMIC_RELAXED);
+    char* dents = malloc(WALK_DENTS_SIZE);
+    if (!dents) {
+        perror("Failed to allocate memory");
+        __atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+    }
+    struct ingest_chunk* chunk = NULL;
+    for (;;) {
+        struct walk_task task;
+        if (walk_take(w, id, &task)) {
+            // Without a buffer the tasks are only drained
+            if (dents) {
+                chunk = walk_directory(w, id, &task, dents, chunk);
+            }
+            walk_dir_put(task.parent);
+            free(task.path);
+            walk_task_done(w);
+            continue;
+        }
+        // Nothing to steal: sleep until a push or the end of the walk
+        pthread_mutex_lock(&w->lock);
+        __atomic_add_fetch(&w->idle, 1, __ATOMIC_SEQ_CST);
+        int done = 0;
+        for (;;) {
+            if (__atomic_load_n(&w->pending, __ATOMIC_SEQ_CST) == 0) {
+                done = 1;
+                break;
+            }
+            if (walk_take(w, id, &task)) {
+                break;
+            }
+            pthread_cond_wait(&w->work_ready, &w->lock);
+        }
+        __atomic_sub_fetch(&w->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&w->lock);
+        if (done) {
+            break;
+        }
+        // Put the stolen task back on our own deque and go round again
+        walk_push(w, id, task.path, task.len, task.depth, task.parent, task.name_off);
+        walk_task_done(w);
+    }
+    free(dents);
+    if (chunk && chunk->count > 0) {
+        walk_submit(w, chunk);
+    } else {
+        free(chunk);
+    }
+    pthread_mutex_lock(&w->lock);
+    w->finished++;
+    pthread_cond_signal(&w->out_ready);
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Add a root and queue it for walking when it is a directory
+int walk_root(struct store* st, struct walker* w, const char* path) {
+    size_t len;
+    unsigned char hash[HASH_SIZE];
+    char* abs_path = resolve_path(path, &len, hash, NULL);
+    struct stat sb;
+    stats.stat_calls += abs_path != NULL;
+    if (!abs_path || stat(abs_path, &sb) != 0) {
+        report_unresolved(path, errno);
+        free(abs_path);
+        return 0;
+    }
+    int type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+    const char* name = strrchr(abs_path, '/');
+    name = name[1] ? name + 1 : name;
+    int added = walk_matches(name, type, 0) ? store_path(st, abs_path, len, hash) : 0;
+    if (type == DT_DIR && walk_max_depth != 0) {
+        walk_push(w, 0, abs_path, len, 0, NULL, 0);
+    } else {
+        free(abs_path);
+    }
+    return added;
+}
+
+// Add everything under the given roots (arguments and stdin lines) on
+// jobs walker threads, while this thread feeds the results to the store.
+// Entries arrive in no particular order. Returns -1 when entries were
+// dropped or no walker started.
+int walk_paths(struct store* st, int argc, char** argv, int has_input, long jobs) {
+    struct walker w;
+    memset(&w, 0, sizeof(w));
+    w.jobs = jobs;
+    w.deques = calloc((size_t)jobs, sizeof(struct walk_deque));
+    pthread_t* workers = malloc((size_t)jobs * sizeof(pthread_t));
+    if (!w.deques || !workers) {
+        perror("Failed to allocate memory");
+        free(w.deques);
+        free(workers);
+        return -1;
+    }
+    for (long i = 0; i < jobs; i++) {
+        pthread_mutex_init(&w.deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.work_ready, NULL);
+    pthread_cond_init(&w.out_ready, NULL);
+    pthread_cond_init(&w.out_space, NULL);
+    // A directory stays open while its subdirectories wait in a deque, so
+    // deep trees need more descriptors than the usual soft limit
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+
+    int count = 0;
+    for (int i = 0; i < argc; i++) {
+        glob_t glob_result;
+        if (glob(argv[i], GLOB_TILDE, NULL, &glob_result) == 0) {
+            for (size_t j = 0; j < glob_result.gl_pathc; j++) {
+                count += walk_root(st, &w, glob_result.gl_pathv[j]);
+            }
+            globfree(&glob_result);
+        }
+    }
+    if (has_input) {
+        char* line = NULL;
+        size_t len = 0;
+        ssize_t read;
+        while ((read = getline(&line, &len, stdin)) != -1) {
+            if (read > 0 && line[read - 1] == '\n') {
+                line[read - 1] = '\0';
+            }
+            if (line[0] != '\0') {
+                count += walk_root(st, &w, line);
+            }
+        }
+        free(line);
+    }
+
+    long started = 0;
+    while (started < jobs && pthread_create(&workers[started], NULL, walk_worker, &w) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        perror("Failed to start walker threads");
+        w.failed = 1;
+    }
+    // Threads that failed to start would own deques nobody drains
+    w.jobs = started;
+
+    int prev = stats_phase(PHASE_RESOLVE);
+    for (;;) {
+        stats_phase(PHASE_RESOLVE);
+        pthread_mutex_lock(&w.lock);
+        while (!w.out_head && w.finished < started) {
+            pthread_cond_wait(&w.out_ready, &w.lock);
+        }
+        struct ingest_chunk* chunk = w.out_head;
+        if (chunk) {
+            w.out_head = chunk->next_work;
+            if (!w.out_head) {
+                w.out_tail = NULL;
+            }
+            w.out_count--;
+            pthread_cond_signal(&w.out_space);
+        }
+        pthread_mutex_unlock(&w.lock);
+        if (!chunk) {
+            break;
+        }
+        stats_phase(PHASE_INDEX);
+        for (size_t i = 0; i < chunk->count; i++) {
+            struct ingest_item* item = &chunk->items[i];
+            if (item->abs_path) {
+                count += store_path(st, item->abs_path, item->path_len, item->hash);
+                free(item->abs_path);
+            } else {
+                report_unresolved(item->path, item->error);
+            }
+            free(item->path);
+        }
+        free(chunk);
+    }
+    stats_phase(prev);
+
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (long i = 0; i < jobs; i++) {
+        // Only left over when no walker started
+        for (size_t j = w.deques[i].head; j < w.deques[i].tail; j++) {
+            free(w.deques[i].tasks[j].path);
+        }
+        pthread_mutex_destroy(&w.deques[i].lock);
+        free(w.deques[i].tasks);
+    }
+    free(w.deques);
+    free(workers);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.work_ready);
+    pthread_cond_destroy(&w.out_ready);
+    pthread_cond_destroy(&w.out_space);
+    return w.failed ? -1 : count;
+}
+
+// Held for the whole invocation and dropped by the kernel when the process
+// exits, so a crashed fsel never leaves a stale lock behind
+int lock_fd = -1;
+
+void lock_alarm(int sig) {
+    (void)sig;
+}
+
+int lock_file(const char* filename, int operation, int* fd);
+
+// Take the selection lock: shared for reading, exclusive for changes.
+// Waits until the lock is free or --timeout runs out; -f skips locking.
+int acquire_lock(int operation, int flags) {
+    if (flags & FORCE_FLAG) {
+        return 0;
+    }
+    return lock_file(lock_filename, operation, &lock_fd);
+}
+
+// Lock one lock file, storing the descriptor holding it in fd
+int lock_file(const char* filename, int operation, int* fd) {
+    int held_fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    *fd = held_fd;
+    if (held_fd == -1) {
+        perror("Failed to open lock file");
+        return -1;
+    }
+    if (flock(held_fd, operation | LOCK_NB) == 0) {
+        return 0;
+    }
+    int rc = -1;
+    int err = errno;
+    int prev = stats_phase(PHASE_LOCK);
+    if (err == EWOULDBLOCK && lock_timeout != 0) {
+        // The alarm interrupts the blocking flock once the timeout is over
+        struct sigaction sa;
+        struct sigaction old_sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = lock_alarm;
+        sigaction(SIGALRM, &sa, &old_sa);
+        struct itimerval timer;
+        memset(&timer, 0, sizeof(timer));
+        if (lock_timeout > 0) {
+            timer.it_value.tv_sec = (time_t)lock_timeout;
+            timer.it_value.tv_usec = (suseconds_t)((lock_timeout - (double)timer.it_value.tv_sec) * 1e6);
+            if (timer.it_value.tv_sec == 0 && timer.it_value.tv_usec == 0) {
+                timer.it_value.tv_usec = 1;
+            }
+            setitimer(ITIMER_REAL, &timer, NULL);
+        }
+        rc = flock(held_fd, operation);
+        err = errno;
+        if (lock_timeout > 0) {
+            memset(&timer, 0, sizeof(timer));
+            setitimer(ITIMER_REAL, &timer, NULL);
+        }
+        sigaction(SIGALRM, &old_sa, NULL);
+    }
+    stats_phase(prev);
+    if (rc != 0) {
+        if (err == EWOULDBLOCK || err == EINTR) {
+            fprintf(stderr, "Error: Selection is locked by another fsel\n");
+        } else {
+            errno = err;
+            perror("Failed to lock selection");
+        }
+        close(held_fd);
+        *fd = -1;
+    }
+    return rc;
+}
+
+void release_lock() {
+    if (lock_fd != -1) {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+}
+
+void remove_storage() {
+    unlink(temp_filename);
+    unlink(index_filename);
+    unlink(free_filename);
+    unlink(lines_filename);
+    unlink(sort_filename);
+    unlink(pack_filename);
+}
+
+// Reference time for the long listing, taken once per listing
+time_t listing_now;
+
+// Function to format time like ls -l
+void format_time(char* buffer, size_t size, time_t time_val) {
+    struct tm tm;
+    localtime_r(&time_val, &tm);
+    // If file is older than 6 months, show year instead of time
+    if (listing_now - time_val > 180 * 24 * 60 * 60) {
+        strftime(buffer, size, "%b %d  %Y", &tm);
+    } else {
+        strftime(buffer, size, "%b %d %H:%M", &tm);
+    }
+}
+
+// uid/gid to name lookups are NSS round trips, so each id is resolved once
+struct name_cache {
+    size_t size;
+    size_t used;
+    unsigned* ids;
+    char** names;
+};
+
+struct name_cache user_names;
+struct name_cache group_names;
+
+const char* lookup_name(unsigned id, int group) {
+    if (group) {
+        struct group* grp = getgrgid((gid_t)id);
+        return grp ? grp->gr_name : "?";
+    }
+    struct passwd* pwd = getpwuid((uid_t)id);
+    return pwd ? pwd->pw_name : "?";
+}
+
+const char* cached_name(struct name_cache* cache, unsigned id, int group) {
+    if ((cache->used + 1) * 2 > cache->size) {
+        size_t size = cache->size ? cache->size * 2 : 64;
+        unsigned* ids = calloc(size, sizeof(unsigned));
+        char** names = calloc(size, sizeof(char*));
+        if (!ids || !names) {
+            free(ids);
+            free(names);
+            return lookup_name(id, group);
+        }
+        for (size_t i = 0; i < cache->size; i++) {
+            if (cache->names[i]) {
+                size_t slot = cache->ids[i] & (size - 1);
+                while (names[slot]) {
+                    slot = (slot + 1) & (size - 1);
+                }
+                ids[slot] = cache->ids[i];
+                names[slot] = cache->names[i];
+            }
+        }
+        free(cache->ids);
+        free(cache->names);
+        cache->ids = ids;
+        cache->names = names;
+        cache->size = size;
+    }
+    size_t slot = id & (cache->size - 1);
+    while (cache->names[slot]) {
+        if (cache->ids[slot] == id) {
+            return cache->names[slot];
+        }
+        slot = (slot + 1) & (cache->size - 1);
+    }
+    const char* name = lookup_name(id, group);
+    char* copy = safe_strdup(name);
+    if (!copy) {
+        return name;
+    }
+    cache->ids[slot] = id;
+    cache->names[slot] = copy;
+    cache->used++;
+    return copy;
+}
+
+// Resolve the ids of the user and group databases into the name caches,
+// so every request forked from the daemon starts with them filled
+void preload_names(void) {
+    unsigned* ids = malloc(DAEMON_PRELOAD_NAMES * sizeof(unsigned));
+    if (!ids) {
+        return;
+    }
+    size_t count = 0;
+    struct passwd* pwd;
+    setpwent();
+    while (count < DAEMON_PRELOAD_NAMES && (pwd = getpwent())) {
+        ids[count++] = (unsigned)pwd->pw_uid;
+    }
+    endpwent();
+    for (size_t i = 0; i < count; i++) {
+        cached_name(&user_names, ids[i], 0);
+    }
+    count = 0;
+    struct group* grp;
+    setgrent();
+    while (count < DAEMON_PRELOAD_NAMES && (grp = getgrent())) {
+        ids[count++] = (unsigned)grp->gr_gid;
+    }
+    endgrent();
+    for (size_t i = 0; i < count; i++) {
+        cached_name(&group_names, ids[i], 1);
+    }
+    free(ids);
+}
+
+// Everything print_file_info() needs, gathered ahead of printing
+struct file_info {
+    char* path;
+    int stat_ok;
+    struct stat st;
+    char* link_target;
+};
+
+void fetch_file_info(struct file_info* fi) {
+    fi->link_target = NULL;
+    fi->stat_ok = lstat(fi->path, &fi->st) == 0;
+    if (fi->stat_ok && S_ISLNK(fi->st.st_mode)) {
+        char link_target[1024];
+        ssize_t len = readlink(fi->path, link_target, sizeof(link_target) - 1);
+        if (len != -1) {
+            link_target[len] = '\0';
+            fi->link_target = safe_strdup(link_target);
+        }
+    }
+}
+
+// Function to print file info in ls -l format
+void print_file_info(const struct file_info* fi) {
+    const struct stat* st = &fi->st;
+    if (!fi->stat_ok) {
+        printf("Could not stat %s\n", fi->path);
+        return;
+    }
+
+    // File type and permissions
+    char perms[11];
+    if (S_ISLNK(st->st_mode)) {
+        perms[0] = 'l';
+    } else if (S_ISDIR(st->st_mode)) {
+        perms[0] = 'd';
+    } else if (S_ISCHR(st->st_mode)) {
+        perms[0] = 'c';
+    } else if (S_ISBLK(st->st_mode)) {
+        perms[0] = 'b';
+    } else if (S_ISFIFO(st->st_mode)) {
+        perms[0] = 'p';
+    } else if (S_ISSOCK(st->st_mode)) {
+        perms[0] = 's';
+    } else {
+        perms[0] = '-';
+    }
+    perms[1] = (st->st_mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (st->st_mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (st->st_mode & S_IXUSR) ? 'x' : '-';
+    perms[4] = (st->st_mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (st->st_mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (st->st_mode & S_IXGRP) ? 'x' : '-';
+    perms[7] = (st->st_mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (st->st_mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (st->st_mode & S_IXOTH) ? 'x' : '-';
+    perms[10] = '\0';
+
+    // Get user and group names
+    const char* user = cached_name(&user_names, (unsigned)st->st_uid, 0);
+    const char* group = cached_name(&group_names, (unsigned)st->st_gid, 1);
+
+    // Format time
+    char time_str[20];
+    format_time(time_str, sizeof(time_str), st->st_mtime);
+
+    // Print in ls -l format with aligned columns
+    printf("%s %3ld %-8s %-8s %8ld %s %s", perms, (long)st->st_nlink, user, group, (long)st->st_size, time_str,
+           fi->path);
+
+    // For symlinks, show the target
+    if (fi->link_target) {
+        printf(" -> %s", fi->link_target);
+    }
+    printf("\n");
+}
+
+// Long listing is double-buffered: while one batch is printed, the next
+// one is being stat'ed in parallel by a prefetch thread
+struct long_batch {
+    struct file_info* items;
+    size_t count;
+    long jobs;
+};
+
+struct long_listing {
+    struct long_batch batches[2];
+    int filling;
+    int in_flight;
+    pthread_t fetcher;
+};
+
+void fetch_one(size_t i, void* arg) {
+    struct long_batch* batch = arg;
+    fetch_file_info(&batch->items[i]);
+}
+
+void* fetch_batch(void* arg) {
+    struct long_batch* batch = arg;
+    parallel_for(batch->count, batch->jobs, fetch_one, batch);
+    return NULL;
+}
+
+void print_batch(struct long_batch* batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        print_file_info(&batch->items[i]);
+        free(batch->items[i].path);
+        free(batch->items[i].link_target);
+    }
+    batch->count = 0;
+}
+
+int long_listing_init(struct long_listing* ll) {
+    memset(ll, 0, sizeof(*ll));
+    long jobs = worker_count > 0 ? worker_count : default_worker_count() * STAT_JOBS_PER_CPU;
+    for (int i = 0; i < 2; i++) {
+        ll->batches[i].items = malloc(STAT_BATCH * sizeof(struct file_info));
+        ll->batches[i].jobs = jobs;
+        if (!ll->batches[i].items) {
+            perror("Failed to allocate memory");
+            free(ll->batches[0].items);
+            return -1;
+        }
+    }
+    tzset();
+    listing_now = time(NULL);
+    return 0;
+}
+
+// Print the batch in flight, then start prefetching the one just filled
+void long_listing_cycle(struct long_listing* ll) {
+    struct long_batch* filled = &ll->batches[ll->filling];
+    struct long_batch* other = &ll->batches[1 - ll->filling];
+    if (ll->in_flight) {
+        pthread_join(ll->fetcher, NULL);
+        print_batch(other);
+        ll->in_flight = 0;
+    }
+    if (filled->count == 0) {
+        return;
+    }
+    // fetch_file_info() does not follow symlinks
+    stats.lstat_calls += filled->count;
+    if (pthread_create(&ll->fetcher, NULL, fetch_batch, filled) == 0) {
+        ll->in_flight = 1;
+    } else {
+        fetch_batch(filled);
+        print_batch(filled);
+        return;
+    }
+    ll->filling = 1 - ll->filling;
+}
+
+void long_listing_add(struct long_listing* ll, const char* path) {
+    struct long_batch* batch = &ll->batches[ll->filling];
+    batch->items[batch->count].path = safe_strdup(path);
+    if (batch->items[batch->count].path && ++batch->count == STAT_BATCH) {
+        long_listing_cycle(ll);
+    }
+}
+
+void long_listing_finish(struct long_listing* ll) {
+    long_listing_cycle(ll);
+    long_listing_cycle(ll);
+    free(ll->batches[0].items);
+    free(ll->batches[1].items);
+}
+
+// Add new path to selection
+int add_mode(int argc, char** argv, int flags) {
+    if (acquire_lock(LOCK_EX, flags) != 0) {
+        return -1;
+    }
+
+    if (flags & REPLACE_FLAG) {
+        FILE* temp_file = fopen(temp_filename, "w");
+        if (!temp_file) {
+            perror("Failed to create temp file");
+            release_lock();
+            return -1;
+        }
+        fclose(temp_file);
+        unlink(index_filename);
+        unlink(free_filename);
+        unlink(lines_filename);
+        unlink(sort_filename);
+        unlink(pack_filename);
+    }
+
+    int has_input = !isatty(fileno(stdin));
+    struct store st;
+    if (store_open(&st, has_input) != 0) {
+        release_lock();
+        return -1;
+    }
+    int count = 0;
+    // Without a cache every path goes to realpath
+    struct resolve_cache* cache = malloc(sizeof(struct resolve_cache));
+    if (cache) {
+        resolve_cache_init(cache);
+    }
+    long jobs = worker_count > 0 ? worker_count : default_worker_count();
+    if (flags & RECURSIVE_FLAG) {
+        count = walk_paths(&st, argc, argv, has_input, jobs);
+        argc = 0;
+        has_input = 0;
+    } else if (jobs > 1) {
+        count = ingest_paths(&st, argc, argv, has_input, jobs);
+        argc = 0;
+        has_input = 0;
+    }
+    stats_phase(PHASE_INPUT);
+    // 1. Process command line arguments
+    for (int i = 0; i < argc; i++) {
+        glob_t glob_result;
+        if (glob(argv[i], GLOB_TILDE | GLOB_MARK, NULL, &glob_result) == 0) {
+            for (size_t j = 0; j < glob_result.gl_pathc; j++) {
+                count += process_path(glob_result.gl_pathv[j], &st, cache);
+            }
+            globfree(&glob_result);
+        }
+    }
+    // 2. Read from stdin ONLY if it's not empty
+    if (has_input) {
+        char* line = NULL;
+        size_t len = 0;
+        ssize_t read;
+        while ((read = getline(&line, &len, stdin)) != -1) {
+            if (read > 0 && line[read - 1] == '\n') {
+                line[read - 1] = '\0';
+            }
+            count += process_path(line, &st, cache);
+        }
+        free(line);
+    }
+    stats_phase(PHASE_OTHER);
+    if (cache) {
+        resolve_cache_free(cache);
+        free(cache);
+    }
+    uint64_t active = st.idx.header->active;
+    // What was added before a failure is kept
+    if (store_close(&st, 1) != 0 || count < 0) {
+        release_lock();
+        return -1;
+    }
+    if (!(flags & QUIET_FLAG)) {
+        printf("%d paths added / %d paths total\n", count, (int)active);
+    }
+    release_lock();
+    return 0;
+}
+
+// Bounded-memory sort of lines. Lines are packed into an arena and sorted
+// by offset; a full arena is written out as a sorted run and the runs are
+// merged on output, so the first line is printed as soon as merging starts.
+struct sorter {
+    char* arena;
+    size_t arena_size;
+    size_t arena_used;
+    size_t* offsets;
+    size_t offsets_size;
+    size_t count;
+    FILE* runs[SORT_MAX_RUNS];
+    size_t run_count;
+};
+
+// Called for every line in order, a nonzero return ends the output early
+typedef int (*sort_emit_fn)(char* line, void* arg);
+
+int compare_arena_lines(const void* a, const void* b, void* arena) {
+    return strcmp((const char*)arena + *(const size_t*)a, (const char*)arena + *(const size_t*)b);
+}
+
+void sorter_init(struct sorter* s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void sorter_free(struct sorter* s) {
+    for (size_t i = 0; i < s->run_count; i++) {
+        fclose(s->runs[i]);
+    }
+    free(s->arena);
+    free(s->offsets);
+    sorter_init(s);
+}
+
+// Runs are unlinked right away and vanish with their stream
+FILE* sort_run_create() {
+    char template[PATH_MAX];
+    int ret = snprintf(template, sizeof(template), "%s.sortXXXXXX", temp_filename);
+    if (ret < 0 || ret >= (int)sizeof(template)) {
+        fprintf(stderr, "Error: Path too long for sort run\n");
+        return NULL;
+    }
+    int fd = mkstemp(template);
+    if (fd == -1) {
+        perror("Failed to create sort run");
+        return NULL;
+    }
+    unlink(template);
+    FILE* run = fdopen(fd, "w+");
+    if (!run) {
+        perror("Failed to open sort run");
+        close(fd);
+    }
+    return run;
+}
+
+int write_run_line(char* line, void* arg) {
+    return fputs(line, (FILE*)arg) == EOF ? -1 : 0;
+}
+
+// k-way merge of sorted runs through a binary heap of their current lines
+int sort_merge(FILE** runs, size_t run_count, sort_emit_fn emit, void* arg) {
+    char** heads = calloc(run_count, sizeof(char*));
+    size_t* sizes = calloc(run_count, sizeof(size_t));
+    size_t* heap = malloc(run_count * sizeof(size_t));
+    if (!heads || !sizes || !heap) {
+        perror("Failed to allocate memory");
+        free(heads);
+        free(sizes);
+        free(heap);
+        return -1;
+    }
+    size_t heap_size = 0;
+    for (size_t i = 0; i < run_count; i++) {
+        rewind(runs[i]);
+        if (getline(&heads[i], &sizes[i], runs[i]) != -1) {
+            // Sift the new run up
+            size_t pos = heap_size++;
+            while (pos > 0 && strcmp(heads[i], heads[heap[(pos - 1) / 2]]) < 0) {
+                heap[pos] = heap[(pos - 1) / 2];
+                pos = (pos - 1) / 2;
+            }
+            heap[pos] = i;
+        }
+    }
+    int rc = 0;
+    while (heap_size > 0) {
+        size_t top = heap[0];
+        rc = emit(heads[top], arg);
+        if (rc != 0) {
+            break;
+        }
+        if (getline(&heads[top], &sizes[top], runs[top]) == -1) {
+            top = heap[--heap_size];
+        }
+        // Sift the replacement down from the root
+        size_t pos = 0;
+        for (;;) {
+            size_t child = pos * 2 + 1;
+            if (child >= heap_size) {
+                break;
+            }
+            if (child + 1 < heap_size && strcmp(heads[heap[child + 1]], heads[heap[child]]) < 0) {
+                child++;
+            }
+            if (strcmp(heads[heap[child]], heads[top]) >= 0) {
+                break;
+            }
+            heap[pos] = heap[child];
+            pos = child;
+        }
+        if (heap_size > 0) {
+            heap[pos] = top;
+        }
+    }
+    for (size_t i = 0; i < run_count; i++) {
+        free(heads[i]);
+    }
+    free(heads);
+    free(sizes);
+    free(heap);
+    return rc < 0 ? -1 : 0;
+}
+
+// Sort what the arena holds into a new run. When the run slots are used
+// up, the runs are first merged into one, so any amount of input fits.
+int sorter_spill(struct sorter* s) {
+    if (s->run_count == SORT_MAX_RUNS) {
+        FILE* merged = sort_run_create();
+        if (!merged) {
+            return -1;
+        }
+        if (sort_merge(s->runs, s->run_count, write_run_line, merged) != 0 || fflush(merged) != 0) {
+            perror("Failed to write sort run");
+            fclose(merged);
+            return -1;
+        }
+        for (size_t i = 0; i < s->run_count; i++) {
+            fclose(s->runs[i]);
+        }
+        s->runs[0] = merged;
+        s->run_count = 1;
+    }
+    FILE* run = sort_run_create();
+    if (!run) {
+        return -1;
+    }
+    qsort_r(s->offsets, s->count, sizeof(size_t), compare_arena_lines, s->arena);
+    for (size_t i = 0; i < s->count; i++) {
+        if (fputs(s->arena + s->offsets[i], run) == EOF) {
+            break;
+        }
+    }
+    if (ferror(run) || fflush(run) != 0) {
+        perror("Failed to write sort run");
+        fclose(run);
+        return -1;
+    }
+    s->runs[s->run_count++] = run;
+    s->arena_used = 0;
+    s->count = 0;
+    return 0;
+}
+
+int sorter_add(struct sorter* s, const char* line, size_t len) {
+    size_t need = len + 1;
+    if (s->count > 0 && s->arena_used + need + (s->count + 1) * sizeof(size_t) > sort_memory &&
+        sorter_spill(s) != 0) {
+        return -1;
+    }
+    if (s->arena_used + need > s->arena_size) {
+        size_t size = s->arena_size ? s->arena_size : 65536;
+        while (s->arena_used + need > size) {
+            size *= 2;
+        }
+        char* arena = realloc(s->arena, size);
+        if (!arena) {
+            perror("Failed to allocate memory for lines");
+            return -1;
+        }
+        s->arena = arena;
+        s->arena_size = size;
+    }
+    if (s->count == s->offsets_size) {
+        size_t size = s->offsets_size ? s->offsets_size * 2 : 4096;
+        size_t* offsets = realloc(s->offsets, size * sizeof(size_t));
+        if (!offsets) {
+            perror("Failed to allocate memory for lines");
+            return -1;
+        }
+        s->offsets = offsets;
+        s->offsets_size = size;
+    }
+    memcpy(s->arena + s->arena_used, line, need);
+    s->offsets[s->count++] = s->arena_used;
+    s->arena_used += need;
+    return 0;
+}
+
+// Emit all lines in order: straight from the arena when everything fit,
+// otherwise by merging the runs
+int sorter_finish(struct sorter* s, sort_emit_fn emit, void* arg) {
+    int rc = 0;
+    if (s->run_count == 0) {
+        qsort_r(s->offsets, s->count, sizeof(size_t), compare_arena_lines, s->arena);
+        stats_phase(PHASE_OUTPUT);
+        for (size_t i = 0; i < s->count && rc == 0; i++) {
+            rc = emit(s->arena + s->offsets[i], arg);
+        }
+        rc = rc < 0 ? -1 : 0;
+    } else if (s->count == 0 || sorter_spill(s) == 0) {
+        free(s->arena);
+        s->arena = NULL;
+        // Merging goes along with printing
+        stats_phase(PHASE_OUTPUT);
+        rc = sort_merge(s->runs, s->run_count, emit, arg);
+    } else {
+        rc = -1;
+    }
+    sorter_free(s);
+    return rc;
+}
+
+int write_iov(struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(STDOUT_FILENO, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to write output");
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+// Unsorted plain listing without stdio: the selection is mapped, tombstones
+// are skipped and every run of active lines goes out in one piece,
+// gathered into writev calls. writev copies the bytes; splicing would queue
+// references to page-cache pages that a later delete or slot reuse rewrites.
+int list_plain(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to stat temp file");
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        return 0;
+    }
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map temp file");
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    struct iovec iov[LIST_IOV_MAX];
+    int iov_count = 0;
+    size_t pos = 0;
+    int rc = 0;
+    while (pos < size && rc == 0) {
+        int active = map[pos] == '/';
+        size_t start = pos;
+        while (pos < size && (map[pos] == '/') == active) {
+            char* nl = memchr(map + pos, '\n', size - pos);
+            pos = nl ? (size_t)(nl - map) + 1 : size;
+        }
+        if (!active) {
+            continue;
+        }
+        iov[iov_count].iov_base = map + start;
+        iov[iov_count].iov_len = pos - start;
+        if (++iov_count == LIST_IOV_MAX) {
+            rc = write_iov(iov, iov_count);
+            iov_count = 0;
+        }
+    }
+    if (rc == 0 && iov_count > 0) {
+        rc = write_iov(iov, iov_count);
+    }
+    munmap(map, size);
+    return rc;
+}
+
+// Copy a decoded packed selection to stdout
+int list_stream(FILE* in) {
+    char* buffer = malloc(PACK_BUFFER_SIZE);
+    if (!buffer) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+    int rc = 0;
+    size_t n;
+    while ((n = fread(buffer, 1, PACK_BUFFER_SIZE, in)) > 0) {
+        if (write_all(STDOUT_FILENO, buffer, n) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (ferror(in)) {
+        perror("Failed to read packed selection");
+        rc = -1;
+    }
+    free(buffer);
+    return rc;
+}
+
+void print_listed_line(char* line, int flags, struct long_listing* ll) {
+    if (flags & LONG_FORMAT_FLAG) {
+        line[strcspn(line, "\n")] = '\0';
+        long_listing_add(ll, line);
+    } else {
+        printf("%s", line);
+    }
+}
+
+// Per-directory totals for --counts, one entry per child of the --under
+// directory in the order they are first seen
+struct dir_count {
+    char* path;
+    uint64_t count;
+};
+
+struct dir_counts {
+    struct dir_count* entries;
+    size_t count;
+    size_t size;
+};
+
+int under_matches(const char* path, size_t len) {
+    if (len >= under_prefix_len && memcmp(path, under_prefix, under_prefix_len) == 0) {
+        return 1;
+    }
+    return under_prefix_len > 1 && len == under_prefix_len - 1 && memcmp(path, under_prefix, len) == 0;
+}
+
+// Count a path of the subtree towards its child of the --under directory
+int dir_counts_add(struct dir_counts* dc, const char* path, size_t len) {
+    if (len <= under_prefix_len || memcmp(path, under_prefix, under_prefix_len) != 0) {
+        return 0;
+    }
+    const char* slash = memchr(path + under_prefix_len, '/', len - under_prefix_len);
+    size_t child_len = slash ? (size_t)(slash - path) : len;
+    // Paths come sorted, so a child's paths mostly follow each other
+    if (dc->count > 0) {
+        struct dir_count* last = &dc->entries[dc->count - 1];
+        if (strlen(last->path) == child_len && memcmp(last->path, path, child_len) == 0) {
+            last->count++;
+            return 0;
+        }
+    }
+    if (dc->count == dc->size) {
+        size_t size = dc->size ? dc->size * 2 : 64;
+        struct dir_count* entries = realloc(dc->entries, size * sizeof(struct dir_count));
+        if (!entries) {
+            perror("Failed to allocate memory");
+            return -1;
+        }
+        dc->entries = entries;
+        dc->size = size;
+    }
+    char* child = malloc(child_len + 1);
+    if (!child) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+    memcpy(child, path, child_len);
+    child[child_len] = '\0';
+    dc->entries[dc->count++] = (struct dir_count){child, 1};
+    return 0;
+}
+
+int compare_dir_counts(const void* a, const void* b) {
+    return strcmp(((const struct dir_count*)a)->path, ((const struct dir_count*)b)->path);
+}
+
+// A child shows up twice when paths sorting between it and its own
+// subtree ("/a/b" < "/a/b-1" < "/a/b/c") split its run, so merge first
+void dir_counts_print(struct dir_counts* dc) {
+    qsort(dc->entries, dc->count, sizeof(struct dir_count), compare_dir_counts);
+    for (size_t i = 0; i < dc->count; i++) {
+        uint64_t count = dc->entries[i].count;
+        while (i + 1 < dc->count && strcmp(dc->entries[i].path, dc->entries[i + 1].path) == 0) {
+            count += dc->entries[++i].count;
+        }
+        printf("%llu\t%s\n", (unsigned long long)count, dc->entries[i].path);
+    }
+}
+
+void dir_counts_free(struct dir_counts* dc) {
+    for (size_t i = 0; i < dc->count; i++) {
+        free(dc->entries[i].path);
+    }
+    free(dc->entries);
+}
+
+struct sorted_output {
+    int flags;
+    struct long_listing* ll;
+    struct dir_counts* counts;
+    uint64_t position;
+};
+
+int print_sorted_line(char* line, void* arg) {
+    struct sorted_output* out = arg;
+    if (out->flags & COUNTS_FLAG) {
+        return dir_counts_add(out->counts, line, strcspn(line, "\n"));
+    }
+    uint64_t position = out->position++;
+    if (out->flags & RANGE_FLAG) {
+        if (position < range_start) {
+            return 0;
+        }
+        if (position - range_start >= range_count) {
+            return 1;
+        }
+    }
+    print_listed_line(line, out->flags, out->ll);
+    return 0;
+}
+
+// Print the --range window in storage order. The line table gives the
+// offset of the first line in the window, so only the window is read.
+void list_range(FILE* temp_file, int flags, struct long_listing* ll) {
+    uint64_t skip = range_start;
+    struct stat st;
+    struct line_table lt;
+    if (fstat(fileno(temp_file), &st) == 0 && lines_load(&lt, st.st_size) == 0) {
+        struct lines_header* h = lt.header;
+        uint64_t line_index = range_start;
+        if (h->active != h->count) {
+            // Tombstones shift ranks, so count them off using the flags alone
+            uint64_t rank = 0;
+            for (line_index = 0; line_index < h->count; line_index++) {
+                if (lt.entries[line_index].flags & LINE_ACTIVE && rank++ == range_start) {
+                    break;
+                }
+            }
+        }
+        off_t offset = line_index < h->count ? (off_t)lt.entries[line_index].offset : st.st_size;
+        lines_close(&lt);
+        if (fseeko(temp_file, offset, SEEK_SET) == 0) {
+            skip = 0;
+        }
+    }
+    char* line = NULL;
+    size_t len = 0;
+    uint64_t printed = 0;
+    while (printed < range_count && getline(&line, &len, temp_file) != -1) {
+        if (!is_active_line(line)) {
+            continue;
+        }
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        print_listed_line(line, flags, ll);
+        printed++;
+    }
+    free(line);
+}
+
+// Read the index header without taking the index over. Only a clean
+// header describing the selection as it is on disk is of use.
+int index_peek(struct index_header* ih, off_t temp_size) {
+    int fd = open(index_filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t got = pread(fd, ih, sizeof(*ih), 0);
+    close(fd);
+    if (got != (ssize_t)sizeof(*ih) || memcmp(ih->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+        ih->version != INDEX_VERSION || ih->dirty || ih->total_bytes != (uint64_t)temp_size) {
+        return -1;
+    }
+    return 0;
+}
+
+// The sort index opened for walking: main and pending parts of the order
+// over the mapped selection
+struct sort_view {
+    struct line_table lt;
+    struct sort_source src;
+    struct sort_header sh;
+    uint64_t* order;
+    uint8_t* in_pending;
+};
+
+// Open the sort index, built first when it is missing or stale. Returns 1
+// when there is no usable sort index.
+int sort_view_open(struct sort_view* v, int temp_fd) {
+    struct stat st;
+    struct index_header ih;
+    if (!use_sort_index || fstat(temp_fd, &st) != 0 || index_peek(&ih, st.st_size) != 0) {
+        return 1;
+    }
+    if (lines_load(&v->lt, st.st_size) != 0) {
+        return 1;
+    }
+    struct sort_source* src = &v->src;
+    if (v->lt.header->count != ih.lines || sort_source_open(src, temp_fd, &v->lt) != 0) {
+        lines_close(&v->lt);
+        return 1;
+    }
+    struct sort_header* sh = &v->sh;
+    int fd = open(sort_filename, O_RDONLY);
+    if (fd == -1 || pread(fd, sh, sizeof(*sh), 0) != (ssize_t)sizeof(*sh) || !sort_is_current(sh, &ih)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        fd = sort_build(src, &ih) == 0 ? open(sort_filename, O_RDONLY) : -1;
+        if (fd == -1 || pread(fd, sh, sizeof(*sh), 0) != (ssize_t)sizeof(*sh)) {
+            if (fd != -1) {
+                close(fd);
+            }
+            sort_source_close(src);
+            lines_close(&v->lt);
+            return 1;
+        }
+    }
+    v->order = sort_read(fd, sh);
+    close(fd);
+    if (!v->order) {
+        sort_source_close(src);
+        lines_close(&v->lt);
+        return 1;
+    }
+    madvise((void*)src->map, src->size, MADV_RANDOM);
+
+    // Main entries also found in the pending part are stale reuses
+    const uint64_t* pending = v->order + sh->main_count;
+    v->in_pending = line_bitset(src->count);
+    if (!v->in_pending) {
+        free(v->order);
+        sort_source_close(src);
+        lines_close(&v->lt);
+        return 1;
+    }
+    for (uint64_t i = 0; i < sh->pending_count; i++) {
+        if (pending[i] < src->count) {
+            v->in_pending[pending[i] / 8] |= 1 << (pending[i] % 8);
+        }
+    }
+    return 0;
+}
+
+void sort_view_close(struct sort_view* v) {
+    free(v->in_pending);
+    free(v->order);
+    sort_source_close(&v->src);
+    lines_close(&v->lt);
+}
+
+// Whether entry i of the main (or pending) part still names its line
+int sort_view_live(const struct sort_view* v, int pending, uint64_t i) {
+    uint64_t line = v->order[pending ? v->sh.main_count + i : i];
+    return line < v->src.count && v->src.entries[line].flags & LINE_ACTIVE &&
+           (pending || !(v->in_pending[line / 8] & (1 << (line % 8))));
+}
+
+// Compare a stored line, newline included, with key
+int compare_line_key(const struct sort_source* src, uint64_t line, const char* key, size_t key_len) {
+    const struct line_entry* e = &src->entries[line];
+    size_t n = e->length < key_len ? e->length : key_len;
+    int r = memcmp(src->map + e->offset, key, n);
+    if (r != 0) {
+        return r;
+    }
+    return (e->length > key_len) - (e->length < key_len);
+}
+
+// First position in the main (or pending) part whose live entries are not
+// below key. Dead entries hold no usable order and are stepped over.
+uint64_t sort_view_lower(const struct sort_view* v, int pending, const char* key, size_t key_len) {
+    const uint64_t* part = pending ? v->order + v->sh.main_count : v->order;
+    uint64_t lo = 0;
+    uint64_t hi = pending ? v->sh.pending_count : v->sh.main_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        uint64_t k = mid;
+        while (k < hi && !sort_view_live(v, pending, k)) {
+            k++;
+        }
+        if (k < hi && compare_line_key(&v->src, part[k], key, key_len) < 0) {
+            lo = k + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+typedef int (*sort_visit_fn)(uint64_t line, void* arg);
+
+// Visit lines in path order from position i of the main part and j of the
+// pending part, as long as they start with prefix (any line when NULL).
+// Stops early when fn returns nonzero and passes that on.
+int sort_view_walk(const struct sort_view* v, uint64_t i, uint64_t j, const char* prefix, size_t prefix_len,
+                   sort_visit_fn fn, void* arg) {
+    const uint64_t* main_lines = v->order;
+    const uint64_t* pending = v->order + v->sh.main_count;
+    int rc = 0;
+    while (rc == 0) {
+        while (i < v->sh.main_count && !sort_view_live(v, 0, i)) {
+            i++;
+        }
+        while (j < v->sh.pending_count && !sort_view_live(v, 1, j)) {
+            j++;
+        }
+        uint64_t line;
+        if (i < v->sh.main_count &&
+            (j == v->sh.pending_count || compare_source_lines(&main_lines[i], &pending[j], (void*)&v->src) <= 0)) {
+            line = main_lines[i++];
+        } else if (j < v->sh.pending_count) {
+            line = pending[j++];
+        } else {
+            break;
+        }
+        const struct line_entry* e = &v->src.entries[line];
+        if (prefix && (e->length < prefix_len || memcmp(v->src.map + e->offset, prefix, prefix_len) != 0)) {
+            break;
+        }
+        rc = fn(line, arg);
+    }
+    return rc;
+}
+
+// Visit the --under subtree in path order: the directory itself, then the
+// run of lines starting with "DIR/", found by binary search
+int sort_view_walk_under(const struct sort_view* v, sort_visit_fn fn, void* arg) {
+    if (under_prefix_len > 1) {
+        char key[PATH_MAX + 1];
+        memcpy(key, under_prefix, under_prefix_len - 1);
+        key[under_prefix_len - 1] = '\n';
+        for (int pending = 0; pending < 2; pending++) {
+            const uint64_t* part = pending ? v->order + v->sh.main_count : v->order;
+            uint64_t count = pending ? v->sh.pending_count : v->sh.main_count;
+            uint64_t k = sort_view_lower(v, pending, key, under_prefix_len);
+            while (k < count && !sort_view_live(v, pending, k)) {
+                k++;
+            }
+            if (k < count && compare_line_key(&v->src, part[k], key, under_prefix_len) == 0) {
+                int rc = fn(part[k], arg);
+                if (rc != 0) {
+                    return rc;
+                }
+                break;
+            }
+        }
+    }
+    uint64_t i = sort_view_lower(v, 0, under_prefix, under_prefix_len);
+    uint64_t j = sort_view_lower(v, 1, under_prefix, under_prefix_len);
+    return sort_view_walk(v, i, j, under_prefix, under_prefix_len, fn, arg);
+}
+
+struct sorted_walk {
+    int flags;
+    struct long_listing* ll;
+    struct dir_counts* counts;
+    const struct sort_source* src;
+    uint64_t position;
+    struct iovec iov[LIST_IOV_MAX];
+    int iov_count;
+};
+
+// Emit one line of the walk. Returns 1 once the range is complete.
+int sorted_walk_emit(uint64_t line, void* arg) {
+    struct sorted_walk* w = arg;
+    const struct line_entry* e = &w->src->entries[line];
+    if (w->flags & COUNTS_FLAG) {
+        return dir_counts_add(w->counts, w->src->map + e->offset, e->length - 1);
+    }
+    uint64_t position = w->position++;
+    if (w->flags & RANGE_FLAG) {
+        if (position < range_start) {
+            return 0;
+        }
+        if (position - range_start >= range_count) {
+            return 1;
+        }
+    }
+    if (w->flags & LONG_FORMAT_FLAG) {
+        char buf[PATH_MAX + 1];
+        size_t len = e->length < sizeof(buf) ? e->length : sizeof(buf) - 1;
+        memcpy(buf, w->src->map + e->offset, len);
+        buf[len] = '\0';
+        print_listed_line(buf, w->flags, w->ll);
+        return 0;
+    }
+    w->iov[w->iov_count].iov_base = (void*)(w->src->map + e->offset);
+    w->iov[w->iov_count].iov_len = e->length;
+    if (++w->iov_count == LIST_IOV_MAX) {
+        int rc = write_iov(w->iov, w->iov_count);
+        w->iov_count = 0;
+        return rc;
+    }
+    return 0;
+}
+
+// Sorted listing as a walk over the sort index, only over the --under
+// subtree when one is given. Returns 1 when there is no usable sort index
+// and the caller has to sort by itself.
+int list_sorted_index(int temp_fd, int flags, struct long_listing* ll, struct dir_counts* counts) {
+    struct sort_view v;
+    int prev = stats_phase(PHASE_SORT);
+    int rc = sort_view_open(&v, temp_fd);
+    stats_phase(prev);
+    if (rc != 0) {
+        return rc;
+    }
+    struct sorted_walk* w = malloc(sizeof(struct sorted_walk));
+    if (!w) {
+        perror("Failed to allocate memory");
+        sort_view_close(&v);
+        return -1;
+    }
+    w->flags = flags;
+    w->ll = ll;
+    w->counts = counts;
+    w->src = &v.src;
+    w->position = 0;
+    w->iov_count = 0;
+    if (flags & UNDER_FLAG) {
+        rc = sort_view_walk_under(&v, sorted_walk_emit, w);
+    } else {
+        rc = sort_view_walk(&v, 0, 0, NULL, 0, sorted_walk_emit, w);
+    }
+    if (rc >= 0 && w->iov_count > 0) {
+        rc = write_iov(w->iov, w->iov_count);
+    }
+    free(w);
+    sort_view_close(&v);
+    return rc < 0 ? -1 : 0;
+}
+
+// List files like in "ls -l"
+int list_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    if (acquire_lock(flags & CLEAR_FLAG ? LOCK_EX : LOCK_SH, flags) != 0) {
+        return -1;
+    }
+    if (access(temp_filename, F_OK) == -1 && access(pack_filename, F_OK) == -1) {
+        return 0;
+    }
+    stats_phase(PHASE_OUTPUT);
+    FILE* temp_file = fopen(temp_filename, "r");
+    // A packed selection is decoded as it is read; a window starts at its block
+    int packed = !temp_file && errno == ENOENT;
+    if (packed) {
+        temp_file = pack_fopen(flags & RANGE_FLAG && !(flags & SORT_FLAG) ? range_start : 0);
+    }
+    if (!temp_file) {
+        perror("Failed to open temp file");
+        release_lock();
+        return -1;
+    }
+    struct long_listing ll;
+    if (flags & LONG_FORMAT_FLAG && long_listing_init(&ll) != 0) {
+        fclose(temp_file);
+        release_lock();
+        return -1;
+    }
+    struct dir_counts counts = {NULL, 0, 0};
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int indexed = flags & SORT_FLAG && !packed ? list_sorted_index(fileno(temp_file), flags, &ll, &counts) : 1;
+    if (indexed < 0) {
+        if (flags & LONG_FORMAT_FLAG) {
+            long_listing_finish(&ll);
+        }
+        dir_counts_free(&counts);
+        fclose(temp_file);
+        release_lock();
+        return -1;
+    } else if (indexed == 0) {
+        // Listed from the sort index
+    } else if (flags & SORT_FLAG) {
+        struct sorter sorter;
+        sorter_init(&sorter);
+        int rc = 0;
+        stats_phase(PHASE_SORT);
+        while ((read = getline(&line, &len, temp_file)) != -1) {
+            if (!is_active_line(line) || (flags & UNDER_FLAG && !under_matches(line, strcspn(line, "\n")))) {
+                continue;
+            }
+            if ((rc = sorter_add(&sorter, line, (size_t)read)) != 0) {
+                break;
+            }
+        }
+        if (rc == 0) {
+            struct sorted_output out = {flags, &ll, &counts, 0};
+            rc = sorter_finish(&sorter, print_sorted_line, &out);
+        } else {
+            sorter_free(&sorter);
+        }
+        if (rc != 0) {
+            if (flags & LONG_FORMAT_FLAG) {
+                long_listing_finish(&ll);
+            }
+            dir_counts_free(&counts);
+            free(line);
+            fclose(temp_file);
+            release_lock();
+            return -1;
+        }
+    } else if (flags & RANGE_FLAG && packed) {
+        for (uint64_t printed = 0; printed < range_count && getline(&line, &len, temp_file) != -1; printed++) {
+            print_listed_line(line, flags, &ll);
+        }
+    } else if (flags & RANGE_FLAG) {
+        list_range(temp_file, flags, &ll);
+    } else if (!(flags & LONG_FORMAT_FLAG)) {
+        if ((packed ? list_stream(temp_file) : list_plain(fileno(temp_file))) != 0) {
+            fclose(temp_file);
+            release_lock();
+            return -1;
+        }
+    } else {
+        while ((read = getline(&line, &len, temp_file)) != -1) {
+            if (!is_active_line(line)) {
+                continue;
+            }
+            print_listed_line(line, flags, &ll);
+        }
+    }
+    if (flags & LONG_FORMAT_FLAG) {
+        long_listing_finish(&ll);
+    }
+    if (flags & COUNTS_FLAG) {
+        dir_counts_print(&counts);
+    }
+    dir_counts_free(&counts);
+    free(line);
+    fclose(temp_file);
+    if (flags & CLEAR_FLAG) {
+        remove_storage();
+    }
+    release_lock();
+    return 0;
+}
+
+// Clear selection completely
+int clear_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    if (acquire_lock(LOCK_EX, flags) != 0) {
+        return -1;
+    }
+    remove_storage();
+    release_lock();
+    return 0;
+}
+
+// Locks go away with their process, so there is nothing to release;
+// report whether a running fsel holds the lock
+int unlock_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    int fd = open(lock_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("Failed to open lock file");
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        printf("No lock held\n");
+    } else {
+        printf("Selection is locked by a running fsel process\n");
+    }
+    close(fd);
+    fflush(stdout);
+    if (!(flags & QUIET_FLAG)) {
+        // -u used to delete the lock file; say so to scripts still relying on it
+        fprintf(stderr, "Note: -u only reports; the lock ends with the fsel holding it, nothing was removed\n");
+    }
+    return 0;
+}
+
+// Minimal io_uring used to issue a batch of statx calls at once
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+void uring_close(struct uring* r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+int uring_init(struct uring* r, unsigned entries) {
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        uring_close(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            uring_close(r);
+            return -1;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_close(r);
+        return -1;
+    }
+    char* sq = r->sq_ptr;
+    char* cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Take the completions the kernel has posted. Returns -1 when one shows
+// that the kernel cannot do statx here.
+int uring_reap(struct uring* r, char* valid, size_t* completed) {
+    int rc = 0;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+            rc = -1;
+        }
+        valid[cqe->user_data] = cqe->res == 0;
+        head++;
+        (*completed)++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return rc;
+}
+
+// statx() every path of the batch through the ring; valid[i] tells
+// whether paths[i] exists. Fails when the kernel cannot do statx here.
+int uring_stat_batch(struct uring* r, char** paths, char* valid, size_t count) {
+    struct statx* bufs = malloc(r->entries * sizeof(struct statx));
+    if (!bufs) {
+        return -1;
+    }
+    size_t submitted = 0;
+    size_t completed = 0;
+    unsigned tail = *r->sq_tail;
+    int rc = 0;
+    while (completed < count && rc == 0) {
+        unsigned to_submit = 0;
+        while (submitted < count && submitted - completed < r->entries) {
+            unsigned slot = tail & *r->sq_mask;
+            struct io_uring_sqe* sqe = &r->sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)paths[submitted];
+            sqe->len = STATX_TYPE;
+            sqe->off = (uint64_t)(uintptr_t)&bufs[submitted % r->entries];
+            sqe->user_data = submitted;
+            r->sq_array[slot] = slot;
+            tail++;
+            submitted++;
+            to_submit++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        if (syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            rc = -1;
+        }
+        if (uring_reap(r, valid, &completed) != 0) {
+            rc = -1;
+        }
+    }
+    // Requests the kernel took write into bufs and read the paths until
+    // they complete, so wait for them before falling back. Entries it
+    // never took die with the ring, which the caller closes.
+    size_t taken = submitted - (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+    while (completed < taken) {
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            // Cannot tell when the kernel is done with bufs: leave it be
+            return -1;
+        }
+        uring_reap(r, valid, &completed);
+    }
+    free(bufs);
+    return rc;
+}
+
+struct stat_batch {
+    char** paths;
+    char* valid;
+};
+
+void stat_one(size_t i, void* arg) {
+    struct stat_batch* batch = arg;
+    struct stat st;
+    batch->valid[i] = stat(batch->paths[i], &st) == 0;
+}
+
+// Stat a batch of paths concurrently: through io_uring when the kernel
+// allows it, on a thread pool otherwise
+void stat_batch(struct uring* r, char** paths, char* valid, size_t count, long jobs) {
+    int prev = stats_phase(PHASE_VALIDATE);
+    stats.stat_calls += count;
+    if (r->fd >= 0) {
+        if (uring_stat_batch(r, paths, valid, count) == 0) {
+            stats_phase(prev);
+            return;
+        }
+        uring_close(r);
+    }
+    struct stat_batch batch = {paths, valid};
+    parallel_for(count, jobs, stat_one, &batch);
+    stats_phase(prev);
+}
+
+void print_stat_batch(char** paths, const char* valid, size_t count, int flags, int* valid_count,
+                      int* invalid_count) {
+    for (size_t i = 0; i < count; i++) {
+        if (valid[i]) {
+            if (!(flags & INVALID_ONLY_FLAG)) {
+                printf("✓ %s\n", paths[i]);
+            }
+            (*valid_count)++;
+        } else {
+            printf("✗ %s\n", paths[i]);
+            (*invalid_count)++;
+        }
+        free(paths[i]);
+    }
+}
+
+// Check that path are still exist
+int validate_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    if (acquire_lock(LOCK_SH, flags) != 0) {
+        return -1;
+    }
+    if (access(temp_filename, F_OK) == -1 && access(pack_filename, F_OK) == -1) {
+        return 0;
+    }
+    stats_phase(PHASE_OUTPUT);
+    FILE* temp_file = fopen(temp_filename, "r");
+    if (!temp_file && errno == ENOENT) {
+        temp_file = pack_fopen(0);
+    }
+    if (!temp_file) {
+        perror("Failed to open temp file");
+        return -1;
+    }
+    char** paths = malloc(STAT_BATCH * sizeof(char*));
+    char* valid = malloc(STAT_BATCH);
+    if (!paths || !valid) {
+        perror("Failed to allocate memory");
+        free(paths);
+        free(valid);
+        fclose(temp_file);
+        return -1;
+    }
+    struct uring ring;
+    if (uring_init(&ring, URING_ENTRIES) != 0) {
+        ring.fd = -1;
+    }
+    long jobs = worker_count > 0 ? worker_count : default_worker_count() * STAT_JOBS_PER_CPU;
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    size_t count = 0;
+    int valid_count = 0;
+    int invalid_count = 0;
+
+    while ((read = getline(&line, &len, temp_file)) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!is_active_line(line)) {
+            continue;
+        }
+        paths[count] = safe_strdup(line);
+        if (paths[count] && ++count == STAT_BATCH) {
+            stat_batch(&ring, paths, valid, count, jobs);
+            print_stat_batch(paths, valid, count, flags, &valid_count, &invalid_count);
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        stat_batch(&ring, paths, valid, count, jobs);
+        print_stat_batch(paths, valid, count, flags, &valid_count, &invalid_count);
+    }
+    free(line);
+    free(paths);
+    free(valid);
+    uring_close(&ring);
+    fclose(temp_file);
+
+    if (!(flags & QUIET_FLAG)) {
+        printf("Total: %d valid, %d invalid\n", valid_count, invalid_count);
+    }
+
+    return (invalid_count > 0) ? 1 : 0;
+}
+
+// Remove empty lines frov previous deletions
+int compact_storage(struct store* st) {
+    char temp_new[PATH_MAX];
+    char lines_new[PATH_MAX];
+    int ret = snprintf(temp_new, sizeof(temp_new), "%s.new", temp_filename);
+    if (ret < 0 || ret >= (int)sizeof(temp_new)) {
+        fprintf(stderr, "Error: Path too long for temp new file\n");
+        return -1;
+    }
+    ret = snprintf(lines_new, sizeof(lines_new), "%s.new", lines_filename);
+    if (ret < 0 || ret >= (int)sizeof(lines_new)) {
+        fprintf(stderr, "Error: Path too long for line table new file\n");
+        return -1;
+    }
+
+    FILE* temp_file = fopen(temp_filename, "r");
+    if (!temp_file) {
+        perror("Failed to open temp file");
+        return -1;
+    }
+    struct index* idx = &st->idx;
+    uint64_t lines = idx->header->lines;
+    uint64_t* line_map = malloc((lines ? lines : 1) * sizeof(uint64_t));
+    if (!line_map) {
+        perror("Failed to allocate memory");
+        fclose(temp_file);
+        return -1;
+    }
+    FILE* temp_out = fopen(temp_new, "w");
+    if (!temp_out) {
+        perror("Failed to create temp new file");
+        free(line_map);
+        fclose(temp_file);
+        return -1;
+    }
+    struct line_table lt = {-1, 0, NULL, NULL};
+    if (lines_create(&lt, lines_new) != 0) {
+        fclose(temp_out);
+        unlink(temp_new);
+        free(line_map);
+        fclose(temp_file);
+        return -1;
+    }
+
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    uint64_t line_index = 0;
+    uint64_t new_index = 0;
+    uint64_t new_bytes = 0;
+    int rc = 0;
+
+    while ((read = getline(&line, &len, temp_file)) != -1) {
+        if (line_index >= lines) {
+            fprintf(stderr, "Index file out of sync with temp file\n");
+            rc = -1;
+            break;
+        }
+        if (is_active_line(line)) {
+            fprintf(temp_out, "%s", line);
+            if (lines_append(&lt, new_bytes, (size_t)read, LINE_ACTIVE) != 0) {
+                rc = -1;
+                break;
+            }
+            line_map[line_index] = new_index++;
+            new_bytes += (uint64_t)read;
+        } else {
+            line_map[line_index] = UINT64_MAX;
+        }
+        line_index++;
+    }
+
+    free(line);
+    fclose(temp_file);
+    if (fclose(temp_out) != 0) {
+        perror("Failed to write temp new file");
+        rc = -1;
+    }
+
+    for (uint64_t i = line_index; i < lines; i++) {
+        line_map[i] = UINT64_MAX;
+    }
+    if (rc == 0) {
+        rc = index_rehash(idx, index_buckets_for(idx->header->used), line_map, new_index);
+    }
+
+    if (rc == 0 && rename(lines_new, lines_filename) != 0) {
+        perror("Failed to rename line table");
+        rc = -1;
+    }
+    if (rc != 0) {
+        free(line_map);
+        lines_close(&lt);
+        unlink(lines_new);
+        unlink(temp_new);
+        return -1;
+    }
+
+    if (rename(temp_new, temp_filename) != 0) {
+        perror("Failed to rename temp file");
+        free(line_map);
+        lines_close(&lt);
+        unlink(temp_new);
+        return -1;
+    }
+    // Later writes of this batch go to the compacted file
+    close(st->temp_fd);
+    st->temp_fd = open(temp_filename, O_RDWR);
+    lines_close(&st->lines);
+    st->lines = lt;
+    idx->header->active = new_index;
+    idx->header->tombstones = 0;
+    idx->header->tombstone_bytes = 0;
+    idx->header->total_bytes = new_bytes;
+    if (st->sort_fd != -1) {
+        close(st->sort_fd);
+        st->sort_fd = -1;
+        int fd = open(sort_filename, O_RDWR);
+        if (fd == -1 || sort_remap(fd, line_map, lines, idx->header) != 0 ||
+            (st->sort_fd = open(sort_filename, O_RDWR)) == -1) {
+            unlink(sort_filename);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    free(line_map);
+    // No tombstones survive compaction, so the free list starts over
+    free_close(&st->fl);
+    return free_create(&st->fl);
+}
+
+// Tombstones at the end of the selection are cut off right away. That
+// costs no more than the deletes that made them, so deleting recently
+// added paths leaves nothing for compaction.
+int trim_tail(struct store* st) {
+    struct lines_header* lh = st->lines.header;
+    uint64_t count = lh->count;
+    uint64_t bytes = 0;
+    while (count > 0 && !(st->lines.entries[count - 1].flags & LINE_ACTIVE)) {
+        bytes += st->lines.entries[count - 1].length;
+        count--;
+    }
+    if (count == lh->count) {
+        return 0;
+    }
+    struct index_header* h = st->idx.header;
+    if (ftruncate(st->temp_fd, (off_t)(h->total_bytes - bytes)) != 0) {
+        perror("Failed to truncate temp file");
+        return -1;
+    }
+    h->tombstones -= lh->count - count;
+    h->tombstone_bytes -= bytes;
+    h->lines = count;
+    h->total_bytes -= bytes;
+    lh->count = count;
+    return 0;
+}
+
+// Explicit compaction job, so deletes themselves never rewrite the store
+int compact_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    if (acquire_lock(LOCK_EX, flags) != 0) {
+        return -1;
+    }
+    struct store st;
+    if (store_open(&st, 0) != 0) {
+        release_lock();
+        return -1;
+    }
+    uint64_t before = st.idx.header->total_bytes;
+    int prev = stats_phase(PHASE_COMPACT);
+    int rc = 0;
+    if (st.idx.header->tombstones > 0 && (rc = compact_storage(&st)) == 0) {
+        stats.temp_rewritten += st.idx.header->total_bytes;
+    }
+    stats_phase(prev);
+    uint64_t after = st.idx.header->total_bytes;
+    uint64_t active = st.idx.header->active;
+    if (store_close(&st, rc == 0) != 0 || rc != 0) {
+        release_lock();
+        return -1;
+    }
+    if (!(flags & QUIET_FLAG)) {
+        printf("%llu bytes reclaimed / %llu paths total\n", (unsigned long long)(before - after),
+               (unsigned long long)active);
+    }
+    release_lock();
+    return 0;
+}
+
+// Rewrite the selection front-coded, or back to plain lines
+int pack_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    if (acquire_lock(LOCK_EX, flags) != 0) {
+        return -1;
+    }
+    if (flags & UNPACK_FLAG) {
+        int rc = pack_expand();
+        release_lock();
+        return rc;
+    }
+    struct stat st;
+    if (stat(temp_filename, &st) != 0) {
+        // Already packed, or nothing selected
+        release_lock();
+        return 0;
+    }
+    FILE* temp_file = fopen(temp_filename, "r");
+    if (!temp_file) {
+        perror("Failed to open temp file");
+        release_lock();
+        return -1;
+    }
+    uint64_t count;
+    off_t size = pack_write(temp_file, &count);
+    fclose(temp_file);
+    if (size < 0) {
+        release_lock();
+        return -1;
+    }
+    unlink(temp_filename);
+    unlink(index_filename);
+    unlink(free_filename);
+    unlink(lines_filename);
+    unlink(sort_filename);
+    if (!(flags & QUIET_FLAG)) {
+        printf("%llu bytes packed into %llu bytes / %llu paths total\n", (unsigned long long)st.st_size,
+               (unsigned long long)size, (unsigned long long)count);
+    }
+    release_lock();
+    return 0;
+}
+
+// Delete keys are matched the way paths were added: existing paths by
+// their canonical form, vanished ones by the literal string
+char* resolve_delete_key(const char* path) {
+    struct stat st;
+    stats.stat_calls++;
+    if (stat(path, &st) == 0) {
+        stats.realpath_calls++;
+        char* abs_path = realpath(path, NULL);
+        if (!abs_path) {
+            fprintf(stderr, "Invalid path: %s\n", path);
+            return NULL;
+        }
+        return abs_path;
+    }
+    return safe_strdup(path);
+}
+
+int tombstone_line_at(int temp_fd, off_t offset, size_t line_len) {
+    char buf[PATH_MAX + 1];
+    if (line_len > sizeof(buf)) {
+        return -1;
+    }
+    memset(buf, ' ', line_len);
+    buf[line_len - 1] = '\n';
+    if (pwrite(temp_fd, buf, line_len, offset) != (ssize_t)line_len) {
+        perror("Failed to tombstone line");
+        return -1;
+    }
+    stats.temp_rewritten += line_len;
+    return 0;
+}
+
+int delete_key(struct store* st, const char* key, size_t key_len);
+
+// Remove one path from the selection. The index leads straight to its
+// line, so only that line is touched. Returns 1 when a path was removed.
+int delete_path(struct store* st, const char* path) {
+    int prev = stats_phase(PHASE_RESOLVE);
+    char* key = resolve_delete_key(path);
+    if (!key) {
+        stats_phase(prev);
+        return 0;
+    }
+    stats_phase(PHASE_INDEX);
+    int rc = delete_key(st, key, strlen(key));
+    free(key);
+    stats_phase(prev);
+    return rc;
+}
+
+// Remove the stored path equal to key
+int delete_key(struct store* st, const char* key, size_t key_len) {
+    unsigned char hash[HASH_SIZE];
+    hash_path((int)st->idx.header->hash_algo, key, key_len, hash);
+    struct index_bucket* b = store_find(st, key, key_len, hash);
+    if (!b) {
+        return 0;
+    }
+    uint64_t line_index = b->line - 1;
+    struct line_entry* e = &st->lines.entries[line_index];
+    if (tombstone_line_at(st->temp_fd, (off_t)e->offset, e->length) != 0 ||
+        free_push(&st->fl, e->length, line_index, (off_t)e->offset) != 0) {
+        return -1;
+    }
+    index_tombstone(&st->idx, b);
+    e->flags &= ~LINE_ACTIVE;
+    st->lines.header->active--;
+    st->idx.header->active--;
+    st->idx.header->tombstones++;
+    st->idx.header->tombstone_bytes += e->length;
+    return 1;
+}
+
+struct under_paths {
+    const struct sort_source* src;
+    char** paths;
+    size_t count;
+    size_t size;
+};
+
+int under_paths_add(struct under_paths* up, const char* path, size_t len) {
+    if (up->count == up->size) {
+        size_t size = up->size ? up->size * 2 : 256;
+        char** paths = realloc(up->paths, size * sizeof(char*));
+        if (!paths) {
+            return -1;
+        }
+        up->paths = paths;
+        up->size = size;
+    }
+    char* copy = malloc(len + 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    up->paths[up->count++] = copy;
+    return 0;
+}
+
+int collect_under_line(uint64_t line, void* arg) {
+    struct under_paths* up = arg;
+    const struct line_entry* e = &up->src->entries[line];
+    return under_paths_add(up, up->src->map + e->offset, e->length - 1);
+}
+
+// Gather the stored paths of the --under subtree, from the sort index when
+// there is one and by scanning the selection otherwise
+int collect_under(struct under_paths* up) {
+    up->paths = NULL;
+    up->count = 0;
+    up->size = 0;
+    FILE* temp_file = fopen(temp_filename, "r");
+    if (!temp_file) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct sort_view v;
+    int rc = 0;
+    if (sort_view_open(&v, fileno(temp_file)) == 0) {
+        up->src = &v.src;
+        rc = sort_view_walk_under(&v, collect_under_line, up);
+        sort_view_close(&v);
+    } else {
+        char* line = NULL;
+        size_t len = 0;
+        while (rc == 0 && getline(&line, &len, temp_file) != -1) {
+            size_t path_len = strcspn(line, "\n");
+            if (is_active_line(line) && under_matches(line, path_len)) {
+                rc = under_paths_add(up, line, path_len);
+            }
+        }
+        free(line);
+    }
+    fclose(temp_file);
+    return rc;
+}
+
+int delete_mode(int argc, char** argv, int flags) {
+    if (acquire_lock(LOCK_EX, flags) != 0) {
+        return -1;
+    }
+
+    // The subtree is read before the store is opened for changes, while
+    // the index is still clean enough for the sort index to be used
+    struct under_paths under = {NULL, NULL, 0, 0};
+    if (refuse_packed() != 0) {
+        release_lock();
+        return -1;
+    }
+    if (flags & UNDER_FLAG && collect_under(&under) != 0) {
+        perror("Failed to read selection");
+        for (size_t i = 0; i < under.count; i++) {
+            free(under.paths[i]);
+        }
+        free(under.paths);
+        release_lock();
+        return -1;
+    }
+
+    int has_input = !(flags & UNDER_FLAG) && !isatty(fileno(stdin));
+    struct store st;
+    if (store_open(&st, has_input) != 0) {
+        for (size_t i = 0; i < under.count; i++) {
+            free(under.paths[i]);
+        }
+        free(under.paths);
+        release_lock();
+        return -1;
     }
-    int count = 0;
-    // 1. Process command line arguments
-    for (int i = 0; i < argc; i++) {
+
+    int removed = 0;
+    int rc = 0;
+    stats_phase(PHASE_INPUT);
+    for (size_t i = 0; i < under.count; i++) {
+        if (rc >= 0) {
+            rc = delete_key(&st, under.paths[i], strlen(under.paths[i]));
+            removed += rc > 0;
+        }
+        free(under.paths[i]);
+    }
+    free(under.paths);
+    for (int i = 0; i < argc && rc >= 0; i++) {
         glob_t glob_result;
-        if (glob(argv[i], GLOB_TILDE | GLOB_MARK, NULL, &glob_result) == 0) {
-            for (size_t j = 0; j < glob_result.gl_pathc; j++) {
-                count += process_path(glob_result.gl_pathv[j], temp_file, index_file);
+        int glob_ok = glob(argv[i], GLOB_TILDE | GLOB_MARK, NULL, &glob_result);
+        if (glob_ok == 0 && glob_result.gl_pathc > 0) {
+            for (size_t j = 0; j < glob_result.gl_pathc && rc >= 0; j++) {
+                rc = delete_path(&st, glob_result.gl_pathv[j]);
+                removed += rc > 0;
             }
             globfree(&glob_result);
+        } else {
+            if (glob_ok == 0) {
+                globfree(&glob_result);
+            }
+            rc = delete_path(&st, argv[i]);
+            removed += rc > 0;
         }
     }
-    // 2. Read from stdin ONLY if it's not empty
-    if (!isatty(fileno(stdin))) {
+
+    if (has_input && rc >= 0) {
         char* line = NULL;
         size_t len = 0;
         while (getline(&line, &len, stdin) != -1) {
             line[strcspn(line, "\n")] = '\0';
-            count += process_path(line, temp_file, index_file);
+            if (line[0] == '\0') {
+                continue;
+            }
+            rc = delete_path(&st, line);
+            if (rc < 0) {
+                break;
+            }
+            removed += rc;
         }
         free(line);
     }
-    fclose(temp_file);
-    fclose(index_file);
+    stats_phase(PHASE_OTHER);
+
+    if (rc >= 0) {
+        rc = trim_tail(&st);
+    }
+    uint64_t active = st.idx.header->active;
+    if (store_close(&st, rc >= 0) != 0 || rc < 0) {
+        release_lock();
+        return -1;
+    }
+
     if (!(flags & QUIET_FLAG)) {
-        int active = 0;
-        int tombstones = 0;
-        count_storage(&active, &tombstones);
-        (void)tombstones;
-        printf("%d paths added / %d paths total\n", count, active);
+        printf("%d paths removed / %d paths total\n", removed, (int)active);
     }
-    remove_lock_file();
+
+    release_lock();
     return 0;
 }
 
-// List files like in "ls -l"
-int list_mode(int _, char** __, int flags) {
+struct exec_job {
+    pid_t pid;
+    unsigned id;
+    size_t count;
+    char* first;
+};
+
+extern char** environ;
+
+// Wait for one job and report it when it failed, or always with --stats.
+// Returns 1 for a failed
+// job, 0 for a successful one and -1 when the child was not one of the
+// jobs or there was nothing to wait for (errno is ECHILD then).
+int exec_reap(struct exec_job* jobs, long job_count) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, 0)) == -1 && errno == EINTR) {
+    }
+    if (pid == -1) {
+        return -1;
+    }
+    for (long i = 0; i < job_count; i++) {
+        struct exec_job* job = &jobs[i];
+        if (job->pid != pid) {
+            continue;
+        }
+        int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        const char* first = job->first ? job->first : "?";
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Job %u (%zu paths from %s) killed by signal %d\n", job->id, job->count, first,
+                    WTERMSIG(status));
+        } else if (failed || stats_format) {
+            fprintf(stderr, "Job %u (%zu paths from %s) exited with status %d\n", job->id, job->count, first,
+                    WEXITSTATUS(status));
+        }
+        free(job->first);
+        job->first = NULL;
+        job->pid = 0;
+        return failed;
+    }
+    errno = 0;
+    return -1;
+}
+
+// List the selection (as -s, --under and --range pick it) into an
+// unlinked file and return it for reading. The lock is released again, so
+// whatever is done with the paths runs without it.
+FILE* list_snapshot(int flags) {
+    char snapshot_name[PATH_MAX];
+    int ret = snprintf(snapshot_name, sizeof(snapshot_name), "%s.XXXXXX", temp_filename);
+    if (ret < 0 || ret >= (int)sizeof(snapshot_name)) {
+        fprintf(stderr, "Error: Path too long for temp file\n");
+        return NULL;
+    }
+    int snapshot = mkostemp(snapshot_name, O_CLOEXEC);
+    if (snapshot == -1) {
+        perror("Failed to create temp file");
+        return NULL;
+    }
+    unlink(snapshot_name);
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (saved_stdout == -1 || dup2(snapshot, STDOUT_FILENO) == -1) {
+        perror("Failed to list selection");
+        close(snapshot);
+        return NULL;
+    }
+    int rc = list_mode(0, NULL, flags & (FORCE_FLAG | SORT_FLAG | RANGE_FLAG | UNDER_FLAG));
+    release_lock();
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    FILE* paths = rc == 0 && lseek(snapshot, 0, SEEK_SET) == 0 ? fdopen(snapshot, "r") : NULL;
+    if (!paths) {
+        close(snapshot);
+    }
+    return paths;
+}
+
+// Run exec_command through sh -c with the selected paths as its arguments,
+// packing each call up to ARG_MAX and keeping up to -j calls running.
+// The selection is listed into a snapshot first, so the commands run
+// without the lock held and may call fsel themselves.
+int exec_mode(int _, char** __, int flags) {
     (void)_;
     (void)__;
-    if (lock_file_exists() && !(flags & FORCE_FLAG)) {
-        fprintf(stderr, "Error: Lock file exists\n");
+    FILE* paths = list_snapshot(flags);
+    if (!paths) {
         return -1;
     }
-    if (flags & CLEAR_FLAG && create_lock_file(flags & FORCE_FLAG) != 0) {
+
+    // The command sees the paths as "$@"; without it they go at the end
+    char* script = malloc(strlen(exec_command) + sizeof(" \"$@\""));
+    if (!script) {
+        perror("Failed to allocate memory");
+        fclose(paths);
         return -1;
     }
-    if (access(temp_filename, F_OK) == -1) {
-        return 0;
+    strcpy(script, exec_command);
+    if (!strstr(exec_command, "$@")) {
+        strcat(script, " \"$@\"");
     }
-    FILE* temp_file = fopen(temp_filename, "r");
-    if (!temp_file) {
-        perror("Failed to open temp file");
-        if (flags & CLEAR_FLAG)
-            remove_lock_file();
+    char* fixed[] = {"sh", "-c", script, "fsel"};
+    size_t fixed_count = sizeof(fixed) / sizeof(fixed[0]);
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t budget = arg_max > 0 ? (size_t)arg_max : _POSIX_ARG_MAX;
+    size_t used = EXEC_ARG_HEADROOM;
+    for (char** env = environ; *env; env++) {
+        used += strlen(*env) + 1 + sizeof(char*);
+    }
+    for (size_t i = 0; i < fixed_count; i++) {
+        used += strlen(fixed[i]) + 1 + sizeof(char*);
+    }
+    if (used + PATH_MAX + sizeof(char*) > budget) {
+        fprintf(stderr, "Error: environment too large to pass any paths\n");
+        free(script);
+        fclose(paths);
+        return -1;
+    }
+    budget -= used;
+
+    // Like xargs, commands get an empty stdin: they share it, and an fsel
+    // among them would otherwise wait there for paths
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    long job_count = worker_count > 0 ? worker_count : 1;
+    struct exec_job* jobs = calloc((size_t)job_count, sizeof(struct exec_job));
+    size_t argv_size = 1024;
+    char** argv = malloc(argv_size * sizeof(char*));
+    if (!jobs || !argv) {
+        perror("Failed to allocate memory");
+        posix_spawn_file_actions_destroy(&actions);
+        free(jobs);
+        free(argv);
+        free(script);
+        fclose(paths);
         return -1;
     }
+    memcpy(argv, fixed, sizeof(fixed));
+    size_t argc = fixed_count;
+    size_t batch_bytes = 0;
+    uint64_t total = 0;
+    unsigned launched = 0;
+    unsigned failed = 0;
+    long running = 0;
     char* line = NULL;
     size_t len = 0;
     ssize_t read;
-    if (flags & SORT_FLAG) {
-        char** lines = NULL;
-        size_t count = 0;
-        while ((read = getline(&line, &len, temp_file)) != -1) {
-            if (!is_active_line(line)) {
-                continue;
-            }
-            char** tmp = realloc(lines, (count + 1) * sizeof(char*));
-            if (!tmp) {
-                perror("Failed to allocate memory for lines");
-                for (size_t i = 0; i < count; i++) {
-                    free(lines[i]);
+    int rc = 0;
+    for (;;) {
+        read = getline(&line, &len, paths);
+        if (read > 0 && line[read - 1] == '\n') {
+            line[--read] = '\0';
+        }
+        size_t cost = read > 0 ? (size_t)read + 1 + sizeof(char*) : 0;
+        // Launch the batch when it is full or the selection is done
+        if (argc > fixed_count && (read == -1 || batch_bytes + cost > budget)) {
+            while (running == job_count) {
+                int reaped = exec_reap(jobs, job_count);
+                if (reaped >= 0) {
+                    failed += reaped;
+                    running--;
+                } else if (errno == ECHILD) {
+                    break;
                 }
-                free(lines);
-                free(line);
-                fclose(temp_file);
-                if (flags & CLEAR_FLAG)
-                    remove_lock_file();
-                return -1;
             }
-            lines = tmp;
-            lines[count] = safe_strdup(line);
-            count++;
-        }
-        qsort(lines, count, sizeof(char*), compare_strings);
-        for (size_t i = 0; i < count; i++) {
-            if (flags & LONG_FORMAT_FLAG) {
-                lines[i][strcspn(lines[i], "\n")] = '\0';
-                print_file_info(lines[i]);
+            long slot = 0;
+            while (slot < job_count && jobs[slot].pid != 0) {
+                slot++;
+            }
+            argv[argc] = NULL;
+            pid_t pid;
+            int err = slot < job_count ? posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ) : ECHILD;
+            if (err != 0) {
+                fprintf(stderr, "Failed to run command: %s\n", strerror(err));
+                rc = -1;
             } else {
-                printf("%s", lines[i]);
+                jobs[slot] = (struct exec_job){pid, ++launched, argc - fixed_count, safe_strdup(argv[fixed_count])};
+                running++;
             }
-            free(lines[i]);
+            for (size_t i = fixed_count; i < argc; i++) {
+                free(argv[i]);
+            }
+            argc = fixed_count;
+            batch_bytes = 0;
         }
-        free(lines);
-    } else {
-        while ((read = getline(&line, &len, temp_file)) != -1) {
-            if (!is_active_line(line)) {
+        if (read == -1 || rc != 0) {
+            break;
+        }
+        if (read == 0) {
+            continue;
+        }
+        if (argc + 1 == argv_size) {
+            char** grown = realloc(argv, argv_size * 2 * sizeof(char*));
+            if (!grown) {
+                perror("Failed to allocate memory");
+                rc = -1;
+                break;
+            }
+            argv = grown;
+            argv_size *= 2;
+        }
+        argv[argc] = safe_strdup(line);
+        if (!argv[argc]) {
+            rc = -1;
+            break;
+        }
+        argc++;
+        batch_bytes += cost;
+        total++;
+    }
+    while (running > 0) {
+        int reaped = exec_reap(jobs, job_count);
+        if (reaped >= 0) {
+            failed += reaped;
+            running--;
+        } else if (errno == ECHILD) {
+            break;
+        }
+    }
+    for (size_t i = fixed_count; i < argc; i++) {
+        free(argv[i]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    free(line);
+    free(argv);
+    for (long i = 0; i < job_count; i++) {
+        free(jobs[i].first);
+    }
+    free(jobs);
+    free(script);
+    fclose(paths);
+
+    if (!(flags & QUIET_FLAG)) {
+        fprintf(stderr, "%llu paths in %u jobs, %u failed\n", (unsigned long long)total, launched, failed);
+    }
+    if (rc != 0) {
+        return -1;
+    }
+    if (failed > 0) {
+        return 1;
+    }
+    // Like mvs and rms did after their loops, but only once all went well
+    return flags & CLEAR_FLAG ? clear_mode(0, NULL, flags) : 0;
+}
+
+// Copy file contents: a reflink where the filesystem shares extents,
+// copy_file_range inside the kernel otherwise, read and write as a last
+// resort
+int copy_data(int in, int out, off_t size) {
+    if (ioctl(out, FICLONE, in) == 0) {
+        return 0;
+    }
+    off_t done = 0;
+    while (done < size) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, (size_t)(size - done), 0);
+        if (n <= 0) {
+            if (n == 0) {
+                break;
+            }
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+                break;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    if (done >= size) {
+        // Files still growing are copied as far as their size said
+        return 0;
+    }
+    if (lseek(in, done, SEEK_SET) == -1 || lseek(out, done, SEEK_SET) == -1) {
+        return -1;
+    }
+    char* buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    ssize_t n;
+    int rc = 0;
+    while ((n = read(in, buffer, COPY_BUFFER_SIZE)) > 0) {
+        if (write_all(out, buffer, (size_t)n) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (n < 0) {
+        rc = -1;
+    }
+    free(buffer);
+    return rc;
+}
+
+// Owner, mode and times of a copy follow the original, as with cp -a.
+// Ownership is kept where permitted.
+int copy_attributes(int fd, const struct stat* st) {
+    if (fchown(fd, st->st_uid, st->st_gid) != 0 && errno != EPERM) {
+        return -1;
+    }
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    return fchmod(fd, st->st_mode & 07777) == 0 && futimens(fd, times) == 0 ? 0 : -1;
+}
+
+// Append name to the message path in path, returning the old length
+size_t path_push(char* path, const char* name) {
+    size_t len = strlen(path);
+    snprintf(path + len, PATH_MAX - len, "/%s", name);
+    return len;
+}
+
+// Copy one entry and, for a directory, everything in it. path is the
+// source path for messages. Entries vanishing while a tree is copied are
+// skipped. Returns 0 on success, -1 after reporting the failure.
+int copy_entry(int src_dir, const char* src_name, int dst_dir, const char* dst_name, char* path) {
+    struct stat st;
+    if (fstatat(src_dir, src_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno == ENOENT && src_dir != AT_FDCWD) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        int in = openat(src_dir, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        int out = in == -1 ? -1 : openat(dst_dir, dst_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        int rc = out == -1 || copy_data(in, out, st.st_size) != 0 || copy_attributes(out, &st) != 0 ? -1 : 0;
+        int err = errno;
+        if (out != -1 && close(out) != 0 && rc == 0) {
+            rc = -1;
+            err = errno;
+        }
+        if (in != -1) {
+            close(in);
+        }
+        if (rc != 0) {
+            fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(err));
+        }
+        return rc;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(src_dir, src_name, target, sizeof(target) - 1);
+        if (n < 0 || (target[n] = '\0', symlinkat(target, dst_dir, dst_name)) != 0) {
+            fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        if (fchownat(dst_dir, dst_name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0 && errno != EPERM) {
+            fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        utimensat(dst_dir, dst_name, times, AT_SYMLINK_NOFOLLOW);
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (mknodat(dst_dir, dst_name, st.st_mode, st.st_rdev) != 0) {
+            fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    int in = openat(src_dir, src_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1 || mkdirat(dst_dir, dst_name, 0700) != 0) {
+        fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+        if (in != -1) {
+            close(in);
+        }
+        return -1;
+    }
+    int out = openat(dst_dir, dst_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = out == -1 ? NULL : fdopendir(in);
+    if (!dir) {
+        fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+        if (out != -1) {
+            close(out);
+        }
+        close(in);
+        return -1;
+    }
+    int rc = 0;
+    struct dirent* ent;
+    while (rc == 0 && (ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        size_t len = path_push(path, ent->d_name);
+        rc = copy_entry(in, ent->d_name, out, ent->d_name, path);
+        path[len] = '\0';
+    }
+    if (rc == 0 && copy_attributes(out, &st) != 0) {
+        fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+        rc = -1;
+    }
+    closedir(dir);
+    close(out);
+    return rc;
+}
+
+// Remove one entry, emptying directories first. Entries that are already
+// gone count as removed.
+int remove_entry(int dir_fd, const char* name, char* path) {
+    if (unlinkat(dir_fd, name, 0) == 0 || errno == ENOENT) {
+        return 0;
+    }
+    if (errno != EISDIR && errno != EPERM) {
+        fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    int rc = 0;
+    struct dirent* ent;
+    while (rc == 0 && (ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        size_t len = path_push(path, ent->d_name);
+        rc = remove_entry(fd, ent->d_name, path);
+        path[len] = '\0';
+    }
+    closedir(dir);
+    if (rc == 0 && unlinkat(dir_fd, name, AT_REMOVEDIR) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+struct fileop_item {
+    char* path;
+    int done;
+    size_t parent; // nearest ancestor in the batch + 1, 0 if none
+    size_t level;  // number of ancestors in the batch
+};
+
+struct fileop_batch {
+    struct fileop_item* items;
+    int dest_fd;
+    const char* dest;
+    size_t level; // level of the items the current pass works on
+};
+
+// Byte order with '/' below every other byte, so a directory sorts
+// directly before everything under it
+int compare_fileop_items(const void* a, const void* b) {
+    const unsigned char* x = (const unsigned char*)((const struct fileop_item*)a)->path;
+    const unsigned char* y = (const unsigned char*)((const struct fileop_item*)b)->path;
+    while (*x && *x == *y) {
+        x++;
+        y++;
+    }
+    int cx = *x == '/' ? 1 : *x ? *x + 1 : 0;
+    int cy = *y == '/' ? 1 : *y ? *y + 1 : 0;
+    return cx - cy;
+}
+
+// Sort a batch and give every path the number of its ancestors selected in
+// the same batch. Passes run one level at a time, so a directory is copied,
+// moved or removed before the paths under it and never alongside them.
+// Returns the number of levels.
+size_t fileop_levels(struct fileop_item* items, size_t count) {
+    qsort(items, count, sizeof(*items), compare_fileop_items);
+    size_t levels = 0;
+    for (size_t i = 0; i < count; i++) {
+        // The nearest selected ancestor is the previous path or one of its
+        // ancestors, everything sorting in between lies under it
+        size_t up = i;
+        while (up > 0) {
+            const char* dir = items[up - 1].path;
+            size_t dir_len = strlen(dir);
+            if (strncmp(items[i].path, dir, dir_len) == 0 && items[i].path[dir_len] == '/') {
+                break;
+            }
+            up = items[up - 1].parent;
+        }
+        items[i].parent = up;
+        items[i].level = up > 0 ? items[up - 1].level + 1 : 0;
+        if (items[i].level >= levels) {
+            levels = items[i].level + 1;
+        }
+    }
+    return levels;
+}
+
+// Copy path into the target directory under a temporary name and rename
+// it into place once complete, so an interrupted copy never looks done.
+// A rerun clears what an interrupted one left.
+int copy_into(const char* path, int dest_fd, const char* name) {
+    if (faccessat(dest_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(EEXIST));
+        return -1;
+    }
+    unsigned char hash[HASH_SIZE];
+    murmur3_hash(name, strlen(name), hash);
+    char partial[32];
+    snprintf(partial, sizeof(partial), ".fsel-%02x%02x%02x%02x%02x%02x%02x%02x", hash[0], hash[1], hash[2], hash[3],
+             hash[4], hash[5], hash[6], hash[7]);
+    char message_path[PATH_MAX];
+    snprintf(message_path, sizeof(message_path), "%s", partial);
+    if (remove_entry(dest_fd, partial, message_path) != 0) {
+        return -1;
+    }
+    snprintf(message_path, sizeof(message_path), "%s", path);
+    if (copy_entry(AT_FDCWD, path, dest_fd, partial, message_path) != 0) {
+        snprintf(message_path, sizeof(message_path), "%s", partial);
+        remove_entry(dest_fd, partial, message_path);
+        return -1;
+    }
+    if (renameat2(dest_fd, partial, dest_fd, name, RENAME_NOREPLACE) != 0) {
+        fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(errno));
+        snprintf(message_path, sizeof(message_path), "%s", partial);
+        remove_entry(dest_fd, partial, message_path);
+        return -1;
+    }
+    return 0;
+}
+
+void fileop_one(size_t i, void* arg) {
+    struct fileop_batch* batch = arg;
+    struct fileop_item* item = &batch->items[i];
+    if (item->level != batch->level) {
+        return;
+    }
+    const char* path = item->path;
+    const char* name = strrchr(path, '/');
+    name = name && name[1] ? name + 1 : path;
+    char message_path[PATH_MAX];
+    snprintf(message_path, sizeof(message_path), "%s", path);
+    if (fileop == FILEOP_REMOVE) {
+        item->done = remove_entry(AT_FDCWD, path, message_path) == 0;
+        return;
+    }
+    if (fileop == FILEOP_MOVE) {
+        if (renameat2(AT_FDCWD, path, batch->dest_fd, name, RENAME_NOREPLACE) == 0) {
+            item->done = 1;
+            return;
+        }
+        if (errno == ENOENT && faccessat(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
+            // Moved already, by an interrupted run or along with a parent
+            item->done = 1;
+            return;
+        }
+        if (errno != EXDEV) {
+            fprintf(stderr, "Failed to move %s: %s\n", path, strerror(errno));
+            return;
+        }
+        // Another filesystem: copy, then drop the original
+        item->done = copy_into(path, batch->dest_fd, name) == 0 && remove_entry(AT_FDCWD, path, message_path) == 0;
+        return;
+    }
+    item->done = copy_into(path, batch->dest_fd, name) == 0;
+}
+
+// Drop the finished paths of a batch from the selection through the index
+int fileop_drop(struct fileop_item* items, size_t count, int flags) {
+    if (acquire_lock(LOCK_EX, flags) != 0) {
+        return -1;
+    }
+    struct store st;
+    if (store_open(&st, 0) != 0) {
+        release_lock();
+        return -1;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < count && rc >= 0; i++) {
+        if (items[i].done) {
+            rc = delete_key(&st, items[i].path, strlen(items[i].path));
+        }
+    }
+    if (rc >= 0) {
+        rc = trim_tail(&st);
+    }
+    if (store_close(&st, rc >= 0) != 0) {
+        rc = -1;
+    }
+    release_lock();
+    return rc < 0 ? -1 : 0;
+}
+
+// --cp, --mv and --rm: work through the selection on -j threads, one
+// path per task, and take each finished batch out of the selection (for
+// --cp only with -c), so an interrupted run picks up where it stopped.
+// Selected paths under another selected path of the batch wait for it.
+int fileop_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    int drop = fileop != FILEOP_COPY || flags & CLEAR_FLAG;
+    if (drop && refuse_packed() != 0) {
+        return -1;
+    }
+    struct fileop_batch batch = {NULL, -1, fileop_dest, 0};
+    if (fileop != FILEOP_REMOVE) {
+        batch.dest_fd = open(fileop_dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (batch.dest_fd == -1) {
+            fprintf(stderr, "Failed to open target directory %s: %s\n", fileop_dest, strerror(errno));
+            return -1;
+        }
+    }
+    // A directory cannot go into itself
+    char* dest_real = fileop != FILEOP_REMOVE ? realpath(fileop_dest, NULL) : NULL;
+    FILE* paths = list_snapshot(flags);
+    batch.items = malloc(FILEOP_BATCH * sizeof(struct fileop_item));
+    if (!paths || !batch.items) {
+        if (paths) {
+            fclose(paths);
+        }
+        free(batch.items);
+        free(dest_real);
+        if (batch.dest_fd != -1) {
+            close(batch.dest_fd);
+        }
+        return -1;
+    }
+    long jobs = worker_count > 0 ? worker_count : default_worker_count();
+    uint64_t done = 0;
+    uint64_t failed = 0;
+    int rc = 0;
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read = 0;
+    while (rc == 0 && read != -1) {
+        size_t count = 0;
+        while (count < FILEOP_BATCH && (read = getline(&line, &len, paths)) != -1) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] == '\0') {
                 continue;
             }
-            if (flags & LONG_FORMAT_FLAG) {
-                line[strcspn(line, "\n")] = '\0';
-                print_file_info(line);
-            } else {
-                printf("%s", line);
+            size_t line_len = strlen(line);
+            if (dest_real && strncmp(dest_real, line, line_len) == 0 &&
+                (dest_real[line_len] == '\0' || dest_real[line_len] == '/')) {
+                fprintf(stderr, "Cannot %s %s into itself\n", fileop == FILEOP_MOVE ? "move" : "copy", line);
+                failed++;
+                continue;
             }
+            batch.items[count].path = safe_strdup(line);
+            batch.items[count].done = 0;
+            if (!batch.items[count].path) {
+                failed++;
+                continue;
+            }
+            count++;
+        }
+        size_t levels = fileop_levels(batch.items, count);
+        for (batch.level = 0; batch.level < levels; batch.level++) {
+            parallel_for(count, jobs, fileop_one, &batch);
+        }
+        uint64_t batch_done = 0;
+        for (size_t i = 0; i < count; i++) {
+            batch_done += batch.items[i].done;
+        }
+        done += batch_done;
+        failed += count - batch_done;
+        if (drop && batch_done > 0) {
+            rc = fileop_drop(batch.items, count, flags);
+        }
+        for (size_t i = 0; i < count; i++) {
+            free(batch.items[i].path);
         }
     }
     free(line);
-    fclose(temp_file);
-    if (flags & CLEAR_FLAG) {
-        unlink(temp_filename);
-        unlink(index_filename);
-        remove_lock_file();
+    free(batch.items);
+    free(dest_real);
+    fclose(paths);
+    if (batch.dest_fd != -1) {
+        close(batch.dest_fd);
     }
-    return 0;
+    if (!(flags & QUIET_FLAG)) {
+        static const char* const verbs[] = {"copied", "moved", "removed"};
+        printf("%llu paths %s, %llu failed\n", (unsigned long long)done, verbs[fileop], (unsigned long long)failed);
+    }
+    if (rc != 0) {
+        return -1;
+    }
+    return failed > 0 ? 1 : 0;
 }
 
-// Clear selection completely
-int clear_mode(int _, char** __, int flags) {
-    (void)_;
-    (void)__;
-    if (lock_file_exists() && !(flags & FORCE_FLAG)) {
-        fprintf(stderr, "Error: Lock file exists\n");
+int setup_filenames(const char* name);
+int valid_selection_name(const char* name);
+
+struct setop_operand {
+    const char* name;
+    int lock_fd;
+    int is_target;
+    struct store st;
+};
+
+// Open a store of another selection for reading. The storage file names
+// are switched while it opens and switched back to the target afterwards.
+// Returns 1 when its index has to be brought up to date first.
+int setop_open(struct setop_operand* op, const char* target) {
+    if (setup_filenames(op->name) != 0) {
         return -1;
     }
-    if (create_lock_file(flags & FORCE_FLAG) != 0) {
-        return -1;
+    int rc = -1;
+    if (access(temp_filename, F_OK) == -1 && access(pack_filename, F_OK) == -1) {
+        fprintf(stderr, "Error: No selection named %s\n", op->name);
+    } else {
+        rc = store_open_read(&op->st);
     }
-    unlink(temp_filename);
-    unlink(index_filename);
-    remove_lock_file();
-    return 0;
+    return setup_filenames(target) == 0 ? rc : -1;
 }
 
-// Release possibly stalled lock
-int unlock_mode(int _, char** __, int flags) {
-    (void)_;
-    (void)__;
-    if (!lock_file_exists()) {
-        printf("No lock file found\n");
-        return 0;
+// Rebuild the index of an operand under its exclusive lock, as the next
+// change to it would, so it can be read under a shared one
+int setop_repair(struct setop_operand* op, const char* target, int flags) {
+    int rc = setup_filenames(op->name);
+    int fd = -1;
+    if (rc == 0 && !(flags & FORCE_FLAG)) {
+        rc = lock_file(lock_filename, LOCK_EX, &fd);
     }
-    char response = 'Y';
-    if (!(flags & FORCE_FLAG)) {
-        printf("Other instance of \"fsel\" acquired lock. Release existing lock? [Y/N] ");
-        response = getchar();
+    struct store st;
+    if (rc == 0 && (rc = store_open(&st, 0)) == 0) {
+        rc = store_close(&st, 1);
     }
-    if (response == 'Y' || response == 'y') {
-        if (unlink(lock_filename) == 0) {
-            printf("Lock file removed\n");
-        } else {
-            perror("Failed to remove lock file");
-            return -1;
-        }
+    if (fd != -1) {
+        close(fd);
     }
-    return 0;
+    return setup_filenames(target) == 0 ? rc : -1;
 }
 
-// Check that path are still exist
-int validate_mode(int _, char** __, int flags) {
-    (void)_;
-    (void)__;
-    if (lock_file_exists() && !(flags & FORCE_FLAG)) {
-        fprintf(stderr, "Error: Lock file exists\n");
-        return -1;
-    }
-    if (access(temp_filename, F_OK) == -1) {
-        return 0;
-    }
-    FILE* temp_file = fopen(temp_filename, "r");
-    if (!temp_file) {
-        perror("Failed to open temp file");
+int compare_operand_names(const void* a, const void* b) {
+    const struct setop_operand* x = *(const struct setop_operand* const*)a;
+    const struct setop_operand* y = *(const struct setop_operand* const*)b;
+    return strcmp(x->name, y->name);
+}
+
+// Whether the store holds the path. Operands may use different hash
+// functions, so the path is hashed the way this store's index does.
+int store_contains(struct store* st, const char* path, size_t len) {
+    unsigned char hash[HASH_SIZE];
+    hash_path((int)st->idx.header->hash_algo, path, len, hash);
+    return store_find(st, path, len, hash) != NULL;
+}
+
+// Call fn on every stored path of st, newline stripped
+int store_each(struct store* st, int (*fn)(const char*, size_t, void*), void* arg) {
+    int fd = dup(st->temp_fd);
+    FILE* in = fd == -1 ? NULL : fdopen(fd, "r");
+    if (!in) {
+        perror("Failed to read selection");
+        if (fd != -1) {
+            close(fd);
+        }
         return -1;
     }
     char* line = NULL;
     size_t len = 0;
     ssize_t read;
-    int valid_count = 0;
-    int invalid_count = 0;
-
-    while ((read = getline(&line, &len, temp_file)) != -1) {
-        line[strcspn(line, "\n")] = '\0';
+    int rc = 0;
+    while (rc >= 0 && (read = getline(&line, &len, in)) != -1) {
         if (!is_active_line(line)) {
             continue;
         }
-        struct stat st;
-        if (stat(line, &st) == 0) {
-            printf("✓ %s\n", line);
-            valid_count++;
-        } else {
-            printf("✗ %s\n", line);
-            invalid_count++;
-        }
+        size_t path_len = (size_t)read - (line[read - 1] == '\n');
+        line[path_len] = '\0';
+        rc = fn(line, path_len, arg);
     }
     free(line);
-    fclose(temp_file);
+    fclose(in);
+    return rc < 0 ? -1 : 0;
+}
 
-    if (!(flags & QUIET_FLAG)) {
-        printf("Total: %d valid, %d invalid\n", valid_count, invalid_count);
+struct setop_pass {
+    struct store* target;
+    struct setop_operand* ops;
+    int count;
+    // Operand being read
+    int source;
+    uint64_t added;
+    uint64_t removed;
+};
+
+// Whether a path of the source operand belongs in the result
+int setop_keeps(struct setop_pass* p, const char* path, size_t len) {
+    for (int i = 0; i < p->count; i++) {
+        if (i == p->source || (setop == SETOP_DIFF && i == 0)) {
+            continue;
+        }
+        if (store_contains(&p->ops[i].st, path, len) != (setop == SETOP_INTERSECT)) {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    return (invalid_count > 0) ? 1 : 0;
+int setop_add(const char* path, size_t len, void* arg) {
+    struct setop_pass* p = arg;
+    if (setop != SETOP_UNION && !setop_keeps(p, path, len)) {
+        return 0;
+    }
+    unsigned char hash[HASH_SIZE];
+    hash_path((int)p->target->idx.header->hash_algo, path, len, hash);
+    p->added += store_path(p->target, path, len, hash);
+    return 0;
 }
 
-// Remove empty lines frov previous deletions
-int compact_storage(void) {
-    char temp_new[PATH_MAX];
-    char index_new[PATH_MAX];
-    int ret = snprintf(temp_new, sizeof(temp_new), "%s.new", temp_filename);
-    if (ret < 0 || ret >= (int)sizeof(temp_new)) {
-        fprintf(stderr, "Error: Path too long for temp new file\n");
-        return -1;
+// In place: drop target paths missing from another operand (intersect)
+// or present in one (diff, where the source is a later operand)
+int setop_drop(const char* path, size_t len, void* arg) {
+    struct setop_pass* p = arg;
+    if (setop == SETOP_INTERSECT && setop_keeps(p, path, len)) {
+        return 0;
     }
-    ret = snprintf(index_new, sizeof(index_new), "%s.new", index_filename);
-    if (ret < 0 || ret >= (int)sizeof(index_new)) {
-        fprintf(stderr, "Error: Path too long for index new file\n");
-        return -1;
+    if (setop == SETOP_DIFF && !store_contains(p->target, path, len)) {
+        return 0;
     }
+    int rc = delete_key(p->target, path, len);
+    p->removed += rc > 0;
+    return rc;
+}
 
-    FILE* temp_file = fopen(temp_filename, "r");
-    if (!temp_file) {
-        perror("Failed to open temp file");
+// --union, --intersect and --diff: combine the named selections given as
+// arguments into the selection of -S. Every operand is read once and
+// checked against the others through their indexes, so the work is
+// linear in the paths involved; results go straight into the target's
+// store. A target that is also an operand is updated in place, any other
+// target is replaced.
+int setop_mode(int argc, char** argv, int flags) {
+    const char* target = selection_name ? selection_name : "-";
+    if (argc < 2) {
+        fprintf(stderr, "Error: set operations need at least two selections\n");
         return -1;
     }
-    FILE* index_file = fopen(index_filename, "rb");
-    if (!index_file) {
-        perror("Failed to open index file");
-        fclose(temp_file);
+    struct setop_operand* ops = calloc((size_t)argc + 1, sizeof(struct setop_operand));
+    struct setop_operand** order = calloc((size_t)argc + 1, sizeof(struct setop_operand*));
+    if (!ops || !order) {
+        perror("Failed to allocate memory");
+        free(ops);
+        free(order);
         return -1;
     }
-    FILE* temp_out = fopen(temp_new, "w");
-    if (!temp_out) {
-        perror("Failed to create temp new file");
-        fclose(temp_file);
-        fclose(index_file);
-        return -1;
+    // Checking the operands points the filenames at each of them, so they
+    // are pointed back at the target whatever the outcome
+    int rc = 0;
+    int target_index = -1;
+    for (int i = 0; i < argc && rc == 0; i++) {
+        ops[i].name = argv[i];
+        ops[i].lock_fd = -1;
+        if (strcmp(argv[i], "-") != 0 && !valid_selection_name(argv[i])) {
+            fprintf(stderr, "Error: Invalid selection name: %s\n", argv[i]);
+            rc = -1;
+            break;
+        }
+        for (int j = 0; j < i && rc == 0; j++) {
+            if (strcmp(argv[i], argv[j]) == 0) {
+                fprintf(stderr, "Error: Selection %s given twice\n", argv[i]);
+                rc = -1;
+            }
+        }
+        if (strcmp(argv[i], target) == 0) {
+            ops[i].is_target = 1;
+            target_index = i;
+        }
+        if (rc == 0 && (setup_filenames(argv[i]) != 0 ||
+                        (access(temp_filename, F_OK) == -1 && access(pack_filename, F_OK) == -1))) {
+            fprintf(stderr, "Error: No selection named %s\n", argv[i]);
+            rc = -1;
+        }
     }
-    FILE* index_out = fopen(index_new, "wb");
-    if (!index_out) {
-        perror("Failed to create index new file");
-        fclose(temp_file);
-        fclose(index_file);
-        fclose(temp_out);
-        unlink(temp_new);
+    if (rc == 0 && setop == SETOP_DIFF && target_index > 0) {
+        fprintf(stderr, "Error: --diff can only write into its first selection\n");
+        rc = -1;
+    }
+    if (setup_filenames(target) != 0 || rc != 0) {
+        free(ops);
+        free(order);
         return -1;
     }
+    struct setop_operand out = {target, -1, 1, {0}};
+    struct setop_operand* target_op = target_index >= 0 ? &ops[target_index] : &out;
 
-    char* line = NULL;
-    size_t len = 0;
-    unsigned char hash[HASH_SIZE];
-    int rc = 0;
-
-    while (getline(&line, &len, temp_file) != -1) {
-        if (!is_active_line(line)) {
-            if (fread(hash, HASH_SIZE, 1, index_file) != 1) {
-                fprintf(stderr, "Index file out of sync with temp file\n");
+    // Locks are taken in name order, so that set operations running at
+    // the same time cannot wait on each other in a circle. Only the target
+    // is locked exclusively, the operands are just read.
+    int lock_count = argc;
+    for (int i = 0; i < argc; i++) {
+        order[i] = &ops[i];
+    }
+    if (target_index < 0) {
+        order[lock_count++] = &out;
+    }
+    qsort(order, (size_t)lock_count, sizeof(*order), compare_operand_names);
+    int opened = 0;
+    for (int attempt = 0; rc == 0; attempt++) {
+        for (int i = 0; i < lock_count && rc == 0 && !(flags & FORCE_FLAG); i++) {
+            char lock_name[PATH_MAX];
+            rc = setup_filenames(order[i]->name);
+            snprintf(lock_name, sizeof(lock_name), "%s", lock_filename);
+            if (rc == 0) {
+                rc = lock_file(lock_name, order[i]->is_target ? LOCK_EX : LOCK_SH, &order[i]->lock_fd);
+            }
+        }
+        if (setup_filenames(target) != 0) {
+            rc = -1;
+        }
+        int stale = -1;
+        for (opened = 0; rc == 0 && opened < argc; opened++) {
+            if (ops[opened].is_target) {
+                continue;
+            }
+            int open_rc = setop_open(&ops[opened], target);
+            if (open_rc == 1 && attempt < argc) {
+                stale = opened;
+                break;
+            }
+            if (open_rc != 0) {
+                if (open_rc == 1) {
+                    fprintf(stderr, "Error: Selection %s keeps changing\n", ops[opened].name);
+                }
                 rc = -1;
                 break;
             }
-            continue;
         }
-        fprintf(temp_out, "%s", line);
-        if (fread(hash, HASH_SIZE, 1, index_file) != 1) {
-            fprintf(stderr, "Index file out of sync with temp file\n");
-            rc = -1;
+        if (stale < 0) {
             break;
         }
-        if (fwrite(hash, HASH_SIZE, 1, index_out) != 1) {
-            perror("Failed to write hash");
+        // An operand left with a stale index by an interrupted change is
+        // repaired on its own, then everything is locked again
+        for (int i = 0; i < opened; i++) {
+            if (!ops[i].is_target) {
+                store_close_read(&ops[i].st);
+            }
+        }
+        opened = 0;
+        for (int i = 0; i < lock_count; i++) {
+            if (order[i]->lock_fd != -1) {
+                close(order[i]->lock_fd);
+                order[i]->lock_fd = -1;
+            }
+        }
+        rc = setop_repair(&ops[stale], target, flags);
+    }
+    int target_open = 0;
+    if (rc == 0 && target_index < 0) {
+        // Replaced, as with -r
+        FILE* temp_file = fopen(temp_filename, "w");
+        if (!temp_file) {
+            perror("Failed to create temp file");
             rc = -1;
-            break;
+        } else {
+            fclose(temp_file);
+            unlink(index_filename);
+            unlink(free_filename);
+            unlink(lines_filename);
+            unlink(sort_filename);
+            unlink(pack_filename);
         }
     }
-
-    free(line);
-    fclose(temp_file);
-    fclose(index_file);
-    fclose(temp_out);
-    fclose(index_out);
-
-    if (rc != 0) {
-        unlink(temp_new);
-        unlink(index_new);
-        return -1;
+    if (rc == 0 && store_open(&target_op->st, 1) == 0) {
+        target_open = 1;
+    } else {
+        rc = -1;
     }
 
-    if (rename(temp_new, temp_filename) != 0) {
-        perror("Failed to rename temp file");
-        unlink(temp_new);
-        unlink(index_new);
-        return -1;
-    }
-    if (rename(index_new, index_filename) != 0) {
-        perror("Failed to rename index file");
-        return -1;
+    struct setop_pass pass = {&target_op->st, ops, argc, 0, 0, 0};
+    if (rc == 0 && target_index < 0) {
+        // Union reads every operand, intersect and diff only the first
+        int sources = setop == SETOP_UNION ? argc : 1;
+        for (pass.source = 0; pass.source < sources && rc == 0; pass.source++) {
+            rc = store_each(&ops[pass.source].st, setop_add, &pass);
+        }
+    } else if (rc == 0 && setop == SETOP_UNION) {
+        for (pass.source = 0; pass.source < argc && rc == 0; pass.source++) {
+            if (pass.source != target_index) {
+                rc = store_each(&ops[pass.source].st, setop_add, &pass);
+            }
+        }
+    } else if (rc == 0 && setop == SETOP_INTERSECT) {
+        pass.source = target_index;
+        rc = store_each(&target_op->st, setop_drop, &pass);
+    } else if (rc == 0) {
+        for (pass.source = 1; pass.source < argc && rc == 0; pass.source++) {
+            rc = store_each(&ops[pass.source].st, setop_drop, &pass);
+        }
     }
-    return 0;
-}
-
-int maybe_compact(void) {
-    int active = 0;
-    int tombstones = 0;
-    count_storage(&active, &tombstones);
-    int total = active + tombstones;
-    if (total >= 100 && tombstones * 10 > total * 3) {
-        return compact_storage();
+    if (rc == 0) {
+        rc = trim_tail(&target_op->st) < 0 ? -1 : 0;
     }
-    return 0;
-}
 
-char* resolve_delete_key(const char* path) {
-    struct stat st;
-    if (stat(path, &st) == 0) {
-        char* abs_path = realpath(path, NULL);
-        if (!abs_path) {
-            fprintf(stderr, "Invalid path: %s\n", path);
-            return NULL;
+    uint64_t active = 0;
+    if (target_open) {
+        active = target_op->st.idx.header->active;
+        if (store_close(&target_op->st, rc == 0) != 0) {
+            rc = -1;
         }
-        return abs_path;
     }
-    return safe_strdup(path);
-}
-
-int path_matches_delete(const char* stored, const char* key) {
-    char stored_copy[PATH_MAX];
-    if (strlen(stored) >= sizeof(stored_copy)) {
-        return 0;
+    for (int i = 0; i < opened; i++) {
+        if (!ops[i].is_target) {
+            store_close_read(&ops[i].st);
+        }
     }
-    strcpy(stored_copy, stored);
-    stored_copy[strcspn(stored_copy, "\n")] = '\0';
-    return strcmp(stored_copy, key) == 0;
-}
-
-int key_in_list(char** keys, size_t count, const char* key) {
-    for (size_t i = 0; i < count; i++) {
-        if (strcmp(keys[i], key) == 0) {
-            return 1;
+    for (int i = 0; i < lock_count; i++) {
+        if (order[i]->lock_fd != -1) {
+            close(order[i]->lock_fd);
         }
     }
-    return 0;
-}
-
-int keys_add(char*** keys, size_t* count, const char* path) {
-    char* key = resolve_delete_key(path);
-    if (!key) {
+    free(ops);
+    free(order);
+    if (rc != 0) {
         return -1;
     }
-    if (key_in_list(*keys, *count, key)) {
-        free(key);
-        return 0;
-    }
-    char** tmp = realloc(*keys, (*count + 1) * sizeof(char*));
-    if (!tmp) {
-        perror("Failed to allocate memory");
-        free(key);
-        return -1;
+    if (!(flags & QUIET_FLAG)) {
+        printf("%llu paths added, %llu removed / %llu paths total\n", (unsigned long long)pass.added,
+               (unsigned long long)pass.removed, (unsigned long long)active);
     }
-    *keys = tmp;
-    (*keys)[*count] = key;
-    (*count)++;
     return 0;
 }
 
-void keys_free(char** keys, size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        free(keys[i]);
-    }
-    free(keys);
+double elapsed_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_diff(&now, start);
 }
 
-int collect_delete_targets(int argc, char** argv, char*** keys_out, size_t* count_out) {
-    char** keys = NULL;
+#ifdef FSEL_BENCH
+// Compare hashing throughput of the hash backends over paths from stdin.
+// Only in the fsel-bench build that bench.sh uses.
+int hash_bench_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    (void)flags;
+    char** paths = NULL;
+    size_t* lengths = NULL;
     size_t count = 0;
-
-    for (int i = 0; i < argc; i++) {
-        glob_t glob_result;
-        int glob_ok = glob(argv[i], GLOB_TILDE | GLOB_MARK, NULL, &glob_result);
-        if (glob_ok == 0 && glob_result.gl_pathc > 0) {
-            for (size_t j = 0; j < glob_result.gl_pathc; j++) {
-                if (keys_add(&keys, &count, glob_result.gl_pathv[j]) != 0) {
-                    keys_free(keys, count);
-                    globfree(&glob_result);
-                    return -1;
-                }
-            }
-            globfree(&glob_result);
-        } else {
-            if (glob_ok == 0) {
-                globfree(&glob_result);
+    size_t size = 0;
+    size_t total_len = 0;
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int rc = 0;
+    while ((read = getline(&line, &len, stdin)) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (count == size) {
+            size_t new_size = size ? size * 2 : 1024;
+            char** tmp = realloc(paths, new_size * sizeof(char*));
+            size_t* tmp_lengths = tmp ? realloc(lengths, new_size * sizeof(size_t)) : NULL;
+            if (tmp) {
+                paths = tmp;
             }
-            if (keys_add(&keys, &count, argv[i]) != 0) {
-                keys_free(keys, count);
-                return -1;
+            if (!tmp_lengths) {
+                rc = -1;
+                break;
             }
+            lengths = tmp_lengths;
+            size = new_size;
+        }
+        if (!(paths[count] = strdup(line))) {
+            rc = -1;
+            break;
+        }
+        lengths[count] = strlen(line);
+        total_len += lengths[count];
+        count++;
+    }
+    free(line);
+    if (rc != 0 || count == 0) {
+        if (rc == 0) {
+            fprintf(stderr, "Error: hash benchmark reads paths from stdin\n");
+        } else {
+            perror("Failed to allocate memory");
+        }
+        for (size_t i = 0; i < count; i++) {
+            free(paths[i]);
         }
+        free(paths);
+        free(lengths);
+        return -1;
     }
 
-    if (!isatty(fileno(stdin))) {
-        char* line = NULL;
-        size_t len = 0;
-        while (getline(&line, &len, stdin) != -1) {
-            line[strcspn(line, "\n")] = '\0';
-            if (line[0] != '\0' && keys_add(&keys, &count, line) != 0) {
-                free(line);
-                keys_free(keys, count);
-                return -1;
+    static const struct {
+        const char* name;
+        void (*fn)(const char*, size_t, unsigned char*);
+    } backends[] = {
+        {"murmur3", murmur3_hash},
+        {"sha256", sha256_hash},
+    };
+    printf("%zu paths, %.1f bytes average\n", count, (double)total_len / (double)count);
+    // Keeps the compiler from dropping hashes nobody reads
+    volatile unsigned char sink = 0;
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        unsigned char hash[HASH_SIZE];
+        struct timespec start;
+        size_t rounds = 0;
+        double elapsed;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (size_t i = 0; i < count; i++) {
+                backends[b].fn(paths[i], lengths[i], hash);
+                sink ^= hash[0];
             }
+            rounds++;
+        } while ((elapsed = elapsed_since(&start)) < 0.5);
+        double hashed = (double)count * (double)rounds;
+        printf("%-8s %10.1f ns/path %10.1f MB/s\n", backends[b].name, elapsed * 1e9 / hashed,
+               (double)total_len * (double)rounds / elapsed / 1e6);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(lengths);
+    return 0;
+}
+#endif
+
+// Environment the daemon takes from each request instead of its own
+static const char* const daemon_env[] = {"FSEL_HASH", "FSEL_SORT_MEMORY", "FSEL_SORT_INDEX", "FSEL_STATS"};
+
+// Set inside the daemon, which serves requests with run_command()
+int in_daemon = 0;
+
+// Storage file of the default selection the daemon serves, which clients
+// are matched against
+char daemon_temp_filename[PATH_MAX];
+
+volatile sig_atomic_t daemon_stopping = 0;
+
+int run_command(int argc, char** argv);
+
+void daemon_stop(int sig) {
+    (void)sig;
+    daemon_stopping = 1;
+}
+
+struct daemon_request {
+    uint32_t magic;
+    uint32_t length;
+};
+
+int write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-        free(line);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
     }
+    return 0;
+}
 
-    *keys_out = keys;
-    *count_out = count;
+int read_all(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
     return 0;
 }
 
-int line_matches_keys(const char* line, char** keys, size_t key_count) {
-    for (size_t i = 0; i < key_count; i++) {
-        if (path_matches_delete(line, keys[i])) {
-            return 1;
+int append_string(char** buf, size_t* len, size_t* size, const char* str) {
+    size_t n = strlen(str) + 1;
+    if (*len + n > *size) {
+        size_t new_size = *size ? *size : 1024;
+        while (*len + n > new_size) {
+            new_size *= 2;
+        }
+        char* tmp = realloc(*buf, new_size);
+        if (!tmp) {
+            return -1;
         }
+        *buf = tmp;
+        *size = new_size;
     }
+    memcpy(*buf + *len, str, n);
+    *len += n;
     return 0;
 }
 
-int tombstone_line_at(FILE* temp_file, off_t offset, size_t line_len) {
-    char* buf = malloc(line_len);
-    if (!buf) {
-        perror("Failed to allocate memory");
+// Run the command in a daemon, if one is listening. Returns 0 with its
+// exit status, or -1 when the caller has to run the command itself.
+int daemon_call(int argc, char** argv, int* status) {
+    if (socket_filename[0] == '\0') {
         return -1;
     }
-    memset(buf, ' ', line_len);
-    buf[line_len - 1] = '\n';
-    if (fseek(temp_file, offset, SEEK_SET) != 0) {
-        perror("Failed to seek temp file");
-        free(buf);
+    // The socket may sit in a shared directory such as /tmp, and whoever
+    // listens on it gets our descriptors: only talk to our own daemon
+    struct stat sock_st;
+    if (lstat(socket_filename, &sock_st) != 0) {
         return -1;
     }
-    if (fwrite(buf, 1, line_len, temp_file) != line_len) {
-        perror("Failed to tombstone line");
-        free(buf);
+    if (!S_ISSOCK(sock_st.st_mode) || sock_st.st_uid != getuid()) {
+        fprintf(stderr, "Warning: ignoring %s, not a socket of ours\n", socket_filename);
         return -1;
     }
-    free(buf);
-    return 0;
-}
-
-int tombstone_hash_at(FILE* index_file, int line_index) {
-    unsigned char zero_hash[HASH_SIZE];
-    memset(zero_hash, 0, HASH_SIZE);
-    if (fseek(index_file, (long)line_index * HASH_SIZE, SEEK_SET) != 0) {
-        perror("Failed to seek index file");
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
         return -1;
     }
-    if (fwrite(zero_hash, HASH_SIZE, 1, index_file) != 1) {
-        perror("Failed to tombstone hash");
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_filename);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
         return -1;
     }
-    return 0;
-}
-
-int delete_mode(int argc, char** argv, int flags) {
-    if (lock_file_exists() && !(flags & FORCE_FLAG)) {
-        fprintf(stderr, "Error: Lock file exists\n");
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != getuid()) {
+        fprintf(stderr, "Warning: ignoring %s, served by another user\n", socket_filename);
+        close(sock);
         return -1;
     }
-    if (create_lock_file(flags & FORCE_FLAG) != 0) {
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1) {
+        close(sock);
         return -1;
     }
 
-    char** keys = NULL;
-    size_t key_count = 0;
-    if (collect_delete_targets(argc, argv, &keys, &key_count) != 0) {
-        remove_lock_file();
-        return -1;
+    // Payload: storage file, client environment ("=value" or "" when
+    // unset), then the arguments, each NUL terminated
+    char* payload = NULL;
+    size_t len = 0;
+    size_t size = 0;
+    // Without memory for it the command runs directly
+    int built = append_string(&payload, &len, &size, temp_filename) == 0;
+    for (size_t i = 0; built && i < sizeof(daemon_env) / sizeof(daemon_env[0]); i++) {
+        const char* value = getenv(daemon_env[i]);
+        char entry[PATH_MAX];
+        snprintf(entry, sizeof(entry), "%s%s", value ? "=" : "", value ? value : "");
+        built = append_string(&payload, &len, &size, entry) == 0;
+    }
+    for (int i = 0; built && i < argc; i++) {
+        built = append_string(&payload, &len, &size, argv[i]) == 0;
     }
 
-    int removed = 0;
-    if (access(temp_filename, F_OK) != -1) {
-        FILE* temp_file = fopen(temp_filename, "r+");
-        if (!temp_file) {
-            perror("Failed to open temp file");
-            keys_free(keys, key_count);
-            remove_lock_file();
-            return -1;
-        }
-        FILE* index_file = fopen(index_filename, "r+");
-        if (!index_file) {
-            perror("Failed to open index file");
-            fclose(temp_file);
-            keys_free(keys, key_count);
-            remove_lock_file();
-            return -1;
-        }
+    struct daemon_request req = {DAEMON_MAGIC, (uint32_t)len};
+    int fds[DAEMON_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
 
-        char* line = NULL;
-        size_t len = 0;
-        ssize_t read;
-        off_t offset = 0;
-        int line_index = 0;
+    int rc = -1;
+    int32_t reply;
+    if (built && len <= DAEMON_MAX_REQUEST && sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(req) &&
+        write_all(sock, payload, len) == 0) {
+        if (read_all(sock, &reply, sizeof(reply)) != 0) {
+            // The request may have run partly, so it is not retried here
+            fprintf(stderr, "Error: fsel daemon went away\n");
+            *status = EXIT_FAILURE;
+            rc = 0;
+        } else if (reply != DAEMON_DECLINED) {
+            *status = reply;
+            rc = 0;
+        }
+    }
+    free(payload);
+    close(cwd);
+    close(sock);
+    return rc;
+}
 
-        while ((read = getline(&line, &len, temp_file)) != -1) {
-            size_t line_len = (size_t)read;
-            if (is_active_line(line) && line_matches_keys(line, keys, key_count)) {
-                if (tombstone_line_at(temp_file, offset, line_len) != 0 ||
-                    tombstone_hash_at(index_file, line_index) != 0) {
-                    free(line);
-                    fclose(temp_file);
-                    fclose(index_file);
-                    keys_free(keys, key_count);
-                    remove_lock_file();
-                    return -1;
+// Run one request with the client's descriptors in place of our own. Runs
+// in a child of the daemon, which exits after it.
+int daemon_serve(int client) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != getuid()) {
+        return -1;
+    }
+    struct daemon_request req;
+    int fds[DAEMON_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* cmsg = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    char* payload = NULL;
+    int32_t status = DAEMON_DECLINED;
+    if (got == (ssize_t)sizeof(req) && req.magic == DAEMON_MAGIC && req.length <= DAEMON_MAX_REQUEST &&
+        (payload = malloc(req.length + 1)) && read_all(client, payload, req.length) == 0) {
+        payload[req.length] = '\0';
+        size_t env_count = sizeof(daemon_env) / sizeof(daemon_env[0]);
+        size_t count = 0;
+        for (size_t pos = 0; pos < req.length; pos += strlen(payload + pos) + 1) {
+            count++;
+        }
+        char** strings = malloc((count + 1) * sizeof(char*));
+        count = 0;
+        for (size_t pos = 0; strings && pos < req.length; pos += strlen(payload + pos) + 1) {
+            strings[count++] = payload + pos;
+        }
+        // A client with another $TMPDIR means another selection
+        if (count > env_count + 1 && strcmp(strings[0], daemon_temp_filename) == 0) {
+            strings[count] = NULL;
+            for (size_t i = 0; i < env_count; i++) {
+                if (strings[i + 1][0] == '=') {
+                    setenv(daemon_env[i], strings[i + 1] + 1, 1);
+                } else {
+                    unsetenv(daemon_env[i]);
                 }
-                removed++;
             }
-            offset += read;
-            line_index++;
+            int argc = (int)(count - env_count - 1);
+            char** argv = strings + env_count + 1;
+            for (int i = 0; i < 3; i++) {
+                dup2(fds[i], i);
+            }
+            if (fchdir(fds[3]) == 0) {
+                status = run_command(argc, argv);
+            } else {
+                perror("Failed to enter working directory");
+                status = EXIT_FAILURE;
+            }
+            release_lock();
+            fflush(stdout);
+            fflush(stderr);
         }
-        free(line);
-        fclose(temp_file);
-        fclose(index_file);
+        free(strings);
     }
+    free(payload);
+    for (int i = 0; i < DAEMON_FDS; i++) {
+        close(fds[i]);
+    }
+    return write_all(client, &status, sizeof(status));
+}
 
-    keys_free(keys, key_count);
-
-    if (maybe_compact() != 0) {
-        remove_lock_file();
+// Serve fsel commands over a Unix socket, so each call saves the process
+// start and per-process setup. Each request runs in a forked child, under
+// the same locks as direct access, on the on-disk selection. The children
+// inherit the user and group names resolved here; the selection files are
+// opened and mapped again by each request, from the page cache.
+int daemon_mode(int _, char** __, int flags) {
+    (void)_;
+    (void)__;
+    if (socket_filename[0] == '\0') {
+        fprintf(stderr, "Error: Path too long for daemon socket\n");
         return -1;
     }
-
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("Failed to create daemon socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_filename);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Error: the daemon is already running\n");
+        close(sock);
+        return -1;
+    }
+    // Nobody answers, so whatever socket file is left is stale
+    unlink(socket_filename);
+    mode_t old_umask = umask(0077);
+    int rc = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_umask);
+    if (rc != 0 || listen(sock, 64) != 0) {
+        perror("Failed to listen on daemon socket");
+        close(sock);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // Finished requests are reaped by the kernel
+    signal(SIGCHLD, SIG_IGN);
+    // Stop between requests and take the socket along
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
     if (!(flags & QUIET_FLAG)) {
-        int active = 0;
-        int tombstones = 0;
-        count_storage(&active, &tombstones);
-        (void)tombstones;
-        printf("%d paths removed / %d paths total\n", removed, active);
+        fprintf(stderr, "fsel daemon listening on %s\n", socket_filename);
     }
-
-    remove_lock_file();
-    return 0;
+    snprintf(daemon_temp_filename, sizeof(daemon_temp_filename), "%s", temp_filename);
+    preload_names();
+    in_daemon = 1;
+    rc = 0;
+    while (!daemon_stopping) {
+        int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Failed to accept daemon request");
+            rc = -1;
+            break;
+        }
+        // Each request gets its own process, so a client that is slow to
+        // read its output holds up nobody else, and whatever the request
+        // does to the process state ends with it
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            _exit(daemon_serve(client) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (pid == -1) {
+            perror("Failed to start daemon request");
+        }
+        close(client);
+    }
+    close(sock);
+    unlink(socket_filename);
+    return rc;
 }
 
 int print_help() {
@@ -907,18 +6570,52 @@ int print_help() {
            "  -c          Clear selection after output / Clear selection\n"
            "  -f          Force operation (ignore lock)\n"
            "  -r          Replace the selection with new paths\n"
-           "  -u          Remove the lock file\n"
+           "  -u          Report whether the selection is locked\n"
            "  -v          Validate the selection\n"
            "  -l          Long format output (like ls -l)\n"
            "  -d          Remove paths from selection\n"
+           "  -R          Add directories recursively\n"
+           "  -j N        Use N worker threads for adding and validating, N jobs with -x\n"
+           "  -x CMD      Run shell command CMD with the selected paths as \"$@\"\n"
+           "  --cp DIR    Copy the selected paths into DIR (with -c, dropping copied ones)\n"
+           "  --mv DIR    Move the selected paths into DIR, dropping moved ones\n"
+           "  --rm        Remove the selected paths, dropping removed ones\n"
            "  -h          Show this help\n"
+           "  --invalid   Print only invalid paths when validating\n"
+           "  --range S:N List N paths starting at position S (counted from 0)\n"
+           "  --timeout S Wait at most S seconds for the lock (0 fails at once)\n"
+           "  --name GLOB With -R, add only entries whose name matches GLOB\n"
+           "  --type T    With -R, add only files (f), directories (d) or symlinks (l)\n"
+           "  --maxdepth N With -R, descend at most N levels below each root\n"
+           "  --daemon    Serve fsel commands from a background process\n"
+           "  --compact   Reclaim the space of removed paths\n"
+           "  --pack      Store the selection prefix-compressed until it changes\n"
+           "  --unpack    Store the selection as plain lines again\n"
+           "  --under DIR List (or with -d remove) only paths at or below DIR\n"
+           "  --counts    Count selected paths below each entry of --under DIR\n"
+           "  --stats[=json] Report per-phase times and I/O counters on stderr\n"
+           "  -S NAME     Work on the named selection NAME instead of the default one\n"
+           "  --union A B...     Make the selection the union of selections A, B, ...\n"
+           "  --intersect A B... Make the selection the paths in all of A, B, ...\n"
+           "  --diff A B...      Make the selection the paths of A in none of B, ...\n"
            "\n"
            "When no paths are provided, list mode is used by default.\n"
            "When paths are provided without -r, they are added to the selection.\n");
     return 0;
 }
 
-int main(int argc, char** argv) {
+// Valid selection names are what fits safely into a file name
+int valid_selection_name(const char* name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > SELECTION_NAME_MAX || name[0] == '.') {
+        return 0;
+    }
+    return strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-") == len;
+}
+
+// Point the storage file names at a selection: the default one for NULL
+// or "-", $TMPDIR/fsel_<UID>_<NAME>.* for a named one
+int setup_filenames(const char* name) {
     const char* tmpdir = getenv("TMPDIR");
     if (tmpdir == NULL) {
         tmpdir = "/tmp";
@@ -926,25 +6623,293 @@ int main(int argc, char** argv) {
 
     int uid = getuid();
     int ret;
-    ret = snprintf(temp_filename, sizeof(temp_filename), "%s/fsel_%d.tmp", tmpdir, uid);
+    char base[PATH_MAX];
+    if (name && strcmp(name, "-") != 0) {
+        if (!valid_selection_name(name)) {
+            fprintf(stderr, "Error: Invalid selection name: %s\n", name);
+            return -1;
+        }
+        ret = snprintf(base, sizeof(base), "%s/fsel_%d_%s", tmpdir, uid, name);
+    } else {
+        ret = snprintf(base, sizeof(base), "%s/fsel_%d", tmpdir, uid);
+    }
+    if (ret < 0 || ret >= (int)sizeof(base)) {
+        fprintf(stderr, "Error: Path too long for temp file\n");
+        return -1;
+    }
+    ret = snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", base);
     if (ret < 0 || ret >= (int)sizeof(temp_filename)) {
         fprintf(stderr, "Error: Path too long for temp file\n");
-        return EXIT_FAILURE;
+        return -1;
     }
-    ret = snprintf(index_filename, sizeof(index_filename), "%s/fsel_%d.idx", tmpdir, uid);
+    ret = snprintf(index_filename, sizeof(index_filename), "%s.idx", base);
     if (ret < 0 || ret >= (int)sizeof(index_filename)) {
         fprintf(stderr, "Error: Path too long for index file\n");
-        return EXIT_FAILURE;
+        return -1;
+    }
+    ret = snprintf(free_filename, sizeof(free_filename), "%s.free", base);
+    if (ret < 0 || ret >= (int)sizeof(free_filename)) {
+        fprintf(stderr, "Error: Path too long for free-list file\n");
+        return -1;
+    }
+    ret = snprintf(lines_filename, sizeof(lines_filename), "%s.off", base);
+    if (ret < 0 || ret >= (int)sizeof(lines_filename)) {
+        fprintf(stderr, "Error: Path too long for line table\n");
+        return -1;
+    }
+    ret = snprintf(sort_filename, sizeof(sort_filename), "%s.sort", base);
+    if (ret < 0 || ret >= (int)sizeof(sort_filename)) {
+        fprintf(stderr, "Error: Path too long for sort index\n");
+        return -1;
+    }
+    ret = snprintf(pack_filename, sizeof(pack_filename), "%s.pack", base);
+    if (ret < 0 || ret >= (int)sizeof(pack_filename)) {
+        fprintf(stderr, "Error: Path too long for packed selection\n");
+        return -1;
     }
-    ret = snprintf(lock_filename, sizeof(lock_filename), "%s/fsel_%d.lock", tmpdir, uid);
+    ret = snprintf(lock_filename, sizeof(lock_filename), "%s.lock", base);
     if (ret < 0 || ret >= (int)sizeof(lock_filename)) {
         fprintf(stderr, "Error: Path too long for lock file\n");
-        return EXIT_FAILURE;
+        return -1;
+    }
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        ret = snprintf(socket_filename, sizeof(socket_filename), "%s/fsel.sock", runtime_dir);
+    } else {
+        ret = snprintf(socket_filename, sizeof(socket_filename), "%s/fsel_%d.sock", tmpdir, uid);
+    }
+    if (ret < 0 || ret >= (int)sizeof(socket_filename)) {
+        // No daemon then, direct access still works
+        socket_filename[0] = '\0';
+    }
+    return 0;
+}
+
+// Turn the --under directory into the prefix its paths start with,
+// resolved the way deleted paths are
+int set_under_prefix(const char* dir) {
+    char* key = resolve_delete_key(dir);
+    if (!key) {
+        return -1;
+    }
+    size_t len = strlen(key);
+    while (len > 1 && key[len - 1] == '/') {
+        len--;
+    }
+    if (len + 1 >= sizeof(under_prefix)) {
+        fprintf(stderr, "Error: Path too long: %s\n", dir);
+        free(key);
+        return -1;
+    }
+    memcpy(under_prefix, key, len);
+    if (len == 0 || under_prefix[len - 1] != '/') {
+        under_prefix[len++] = '/';
+    }
+    under_prefix[len] = '\0';
+    under_prefix_len = len;
+    free(key);
+    return 0;
+}
+
+// Process-wide I/O counters from /proc/self/io
+struct proc_io {
+    uint64_t rchar;
+    uint64_t wchar;
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+};
+
+int read_proc_io(struct proc_io* io) {
+    memset(io, 0, sizeof(*io));
+    FILE* f = fopen("/proc/self/io", "re");
+    if (!f) {
+        return -1;
+    }
+    char key[32];
+    unsigned long long value;
+    int found = 0;
+    while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+        uint64_t* field = strcmp(key, "rchar") == 0         ? &io->rchar
+                          : strcmp(key, "wchar") == 0       ? &io->wchar
+                          : strcmp(key, "syscr") == 0       ? &io->syscr
+                          : strcmp(key, "syscw") == 0       ? &io->syscw
+                          : strcmp(key, "read_bytes") == 0  ? &io->read_bytes
+                          : strcmp(key, "write_bytes") == 0 ? &io->write_bytes
+                                                            : NULL;
+        if (field) {
+            *field = value;
+            found++;
+        }
+    }
+    fclose(f);
+    return found > 0 ? 0 : -1;
+}
+
+// Where the command started, for totals; the daemon's counters run on
+// across requests
+struct stats_start {
+    struct timespec wall;
+    struct timespec cpu;
+    struct rusage usage;
+    struct proc_io io;
+    int io_ok;
+} stats_start;
+
+void stats_begin(int format) {
+    if (!stats_format) {
+        clock_gettime(CLOCK_MONOTONIC, &stats_start.wall);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stats_start.cpu);
+        getrusage(RUSAGE_SELF, &stats_start.usage);
+        stats_start.io_ok = read_proc_io(&stats_start.io) == 0;
+        stats.wall_mark = stats_start.wall;
+        stats.cpu_mark = stats_start.cpu;
+    }
+    stats_format = format;
+}
+
+// Print the counters of the command just run on stderr
+void stats_report(int status) {
+    struct timespec wall;
+    struct timespec cpu;
+    struct rusage usage;
+    struct proc_io io;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    getrusage(RUSAGE_SELF, &usage);
+    int io_ok = stats_start.io_ok && read_proc_io(&io) == 0;
+    stats.wall[stats.phase] += timespec_diff(&wall, &stats.wall_mark);
+    stats.cpu[stats.phase] += timespec_diff(&cpu, &stats.cpu_mark);
+    double total_wall = timespec_diff(&wall, &stats_start.wall);
+    double total_cpu = timespec_diff(&cpu, &stats_start.cpu);
+    unsigned long long major = (unsigned long long)(usage.ru_majflt - stats_start.usage.ru_majflt);
+    unsigned long long minor = (unsigned long long)(usage.ru_minflt - stats_start.usage.ru_minflt);
+    if (io_ok) {
+        io.rchar -= stats_start.io.rchar;
+        io.wchar -= stats_start.io.wchar;
+        io.syscr -= stats_start.io.syscr;
+        io.syscw -= stats_start.io.syscw;
+        io.read_bytes -= stats_start.io.read_bytes;
+        io.write_bytes -= stats_start.io.write_bytes;
+    }
+    unsigned long long lookups = (unsigned long long)stats.index_lookups;
+    unsigned long long probes = (unsigned long long)stats.index_probes;
+
+    if (stats_format == STATS_JSON) {
+        fprintf(stderr, "{\"status\":%d,\"wall\":%.6f,\"cpu\":%.6f,\"phases\":{", status, total_wall, total_cpu);
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", i ? "," : "", stats_phase_names[i],
+                    stats.wall[i], stats.cpu[i]);
+        }
+        fprintf(stderr,
+                "},\"index\":{\"lookups\":%llu,\"probes\":%llu,\"mapped_bytes\":%llu},"
+                "\"tombstone_reuse\":{\"hits\":%llu,\"misses\":%llu,\"stale\":%llu},"
+                "\"calls\":{\"realpath\":%llu,\"lstat\":%llu,\"stat\":%llu},"
+                "\"resolve_cache\":{\"hits\":%llu,\"lookups\":%llu},"
+                "\"temp\":{\"appended_bytes\":%llu,\"rewritten_bytes\":%llu},"
+                "\"faults\":{\"major\":%llu,\"minor\":%llu},\"io\":",
+                lookups, probes, (unsigned long long)stats.index_bytes, (unsigned long long)stats.reuse_hits,
+                (unsigned long long)stats.reuse_misses, (unsigned long long)stats.reuse_stale,
+                (unsigned long long)stats.realpath_calls, (unsigned long long)stats.lstat_calls,
+                (unsigned long long)stats.stat_calls, (unsigned long long)stats.resolve_cache_hits,
+                (unsigned long long)stats.resolve_cache_lookups, (unsigned long long)stats.temp_appended,
+                (unsigned long long)stats.temp_rewritten, major, minor);
+        if (io_ok) {
+            fprintf(stderr,
+                    "{\"read_bytes\":%llu,\"write_bytes\":%llu,\"read_calls\":%llu,\"write_calls\":%llu,"
+                    "\"disk_read_bytes\":%llu,\"disk_write_bytes\":%llu}}\n",
+                    (unsigned long long)io.rchar, (unsigned long long)io.wchar, (unsigned long long)io.syscr,
+                    (unsigned long long)io.syscw, (unsigned long long)io.read_bytes,
+                    (unsigned long long)io.write_bytes);
+        } else {
+            fprintf(stderr, "null}\n");
+        }
+        return;
+    }
+
+    fprintf(stderr, "phase          wall s      cpu s\n");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        if (stats.wall[i] > 0 || stats.cpu[i] > 0) {
+            fprintf(stderr, "%-9s %11.6f %10.6f\n", stats_phase_names[i], stats.wall[i], stats.cpu[i]);
+        }
+    }
+    fprintf(stderr, "%-9s %11.6f %10.6f\n", "total", total_wall, total_cpu);
+    fprintf(stderr, "index: %llu lookups, %llu probes (%.2f per lookup), %llu bytes mapped\n", lookups, probes,
+            lookups ? (double)probes / (double)lookups : 0.0, (unsigned long long)stats.index_bytes);
+    fprintf(stderr, "tombstone reuse: %llu hits, %llu misses, %llu stale records skipped\n",
+            (unsigned long long)stats.reuse_hits, (unsigned long long)stats.reuse_misses,
+            (unsigned long long)stats.reuse_stale);
+    fprintf(stderr, "calls: %llu realpath, %llu lstat, %llu stat\n", (unsigned long long)stats.realpath_calls,
+            (unsigned long long)stats.lstat_calls, (unsigned long long)stats.stat_calls);
+    if (stats.resolve_cache_lookups > 0) {
+        fprintf(stderr, "realpath cache: %llu hits / %llu lookups (%.1f%%)\n",
+                (unsigned long long)stats.resolve_cache_hits, (unsigned long long)stats.resolve_cache_lookups,
+                100.0 * (double)stats.resolve_cache_hits / (double)stats.resolve_cache_lookups);
     }
+    fprintf(stderr, ".tmp: %llu bytes appended, %llu bytes rewritten in place\n",
+            (unsigned long long)stats.temp_appended, (unsigned long long)stats.temp_rewritten);
+    if (io_ok) {
+        fprintf(stderr, "io: %llu bytes read in %llu calls, %llu bytes written in %llu calls, disk %llu / %llu bytes\n",
+                (unsigned long long)io.rchar, (unsigned long long)io.syscr, (unsigned long long)io.wchar,
+                (unsigned long long)io.syscw, (unsigned long long)io.read_bytes, (unsigned long long)io.write_bytes);
+    }
+    fprintf(stderr, "page faults: %llu major, %llu minor\n", major, minor);
+}
 
+// Parse one command line and run its mode. Runs once per process, or once
+// per request inside the daemon, so option state starts from defaults.
+int dispatch_command(int argc, char** argv) {
+    worker_count = 0;
+    range_start = 0;
+    range_count = 0;
+    lock_timeout = -1;
+    sort_memory = SORT_MEMORY_DEFAULT;
+    use_sort_index = 1;
+    hash_algo = HASH_MURMUR3;
+    create_hash_algo = HASH_MURMUR3;
+    walk_name = NULL;
+    walk_type = 0;
+    walk_max_depth = -1;
+    exec_command = NULL;
+    fileop = FILEOP_COPY;
+    fileop_dest = NULL;
+    selection_name = NULL;
+    setop = SETOP_UNION;
+    under_prefix[0] = '\0';
+    under_prefix_len = 0;
+    optind = 0;
+
+    static const struct option long_options[] = {
+        {"invalid", no_argument, NULL, INVALID_OPTION},
+        {"range", required_argument, NULL, RANGE_OPTION},
+#ifdef FSEL_BENCH
+        {"hash-bench", no_argument, NULL, HASH_BENCH_OPTION},
+#endif
+        {"compact", no_argument, NULL, COMPACT_OPTION},
+        {"timeout", required_argument, NULL, TIMEOUT_OPTION},
+        {"daemon", no_argument, NULL, DAEMON_OPTION},
+        {"name", required_argument, NULL, NAME_OPTION},
+        {"type", required_argument, NULL, TYPE_OPTION},
+        {"maxdepth", required_argument, NULL, MAXDEPTH_OPTION},
+        {"pack", no_argument, NULL, PACK_OPTION},
+        {"unpack", no_argument, NULL, UNPACK_OPTION},
+        {"under", required_argument, NULL, UNDER_OPTION},
+        {"counts", no_argument, NULL, COUNTS_OPTION},
+        {"cp", required_argument, NULL, CP_OPTION},
+        {"mv", required_argument, NULL, MV_OPTION},
+        {"rm", no_argument, NULL, RM_OPTION},
+        {"stats", optional_argument, NULL, STATS_OPTION},
+        {"selection", required_argument, NULL, 'S'},
+        {"union", no_argument, NULL, UNION_OPTION},
+        {"intersect", no_argument, NULL, INTERSECT_OPTION},
+        {"diff", no_argument, NULL, DIFF_OPTION},
+        {NULL, 0, NULL, 0},
+    };
     int opt;
+    const char* under_dir = NULL;
     int flags = 0;
-    while ((opt = getopt(argc, argv, "qscfruvhld")) != -1) {
+    while ((opt = getopt_long(argc, argv, "qscfruvhldRj:x:S:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'q':
                 flags |= QUIET_FLAG;
@@ -973,6 +6938,130 @@ int main(int argc, char** argv) {
             case 'd':
                 flags |= DELETE_FLAG;
                 break;
+            case 'R':
+                flags |= RECURSIVE_FLAG;
+                break;
+            case 'x':
+                exec_command = optarg;
+                flags |= EXEC_FLAG;
+                break;
+            case 'S':
+                if (strcmp(optarg, "-") != 0 && !valid_selection_name(optarg)) {
+                    fprintf(stderr, "Error: Invalid selection name: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                selection_name = optarg;
+                break;
+            case UNION_OPTION:
+            case INTERSECT_OPTION:
+            case DIFF_OPTION:
+                if (flags & SETOP_FLAG) {
+                    fprintf(stderr, "Error: only one of --union, --intersect and --diff\n");
+                    return EXIT_FAILURE;
+                }
+                setop = opt == UNION_OPTION ? SETOP_UNION : opt == INTERSECT_OPTION ? SETOP_INTERSECT : SETOP_DIFF;
+                flags |= SETOP_FLAG;
+                break;
+            case NAME_OPTION:
+                walk_name = optarg;
+                break;
+            case TYPE_OPTION:
+                if (strcmp(optarg, "f") == 0) {
+                    walk_type = DT_REG;
+                } else if (strcmp(optarg, "d") == 0) {
+                    walk_type = DT_DIR;
+                } else if (strcmp(optarg, "l") == 0) {
+                    walk_type = DT_LNK;
+                } else {
+                    fprintf(stderr, "Error: invalid type: %s (use f, d or l)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case MAXDEPTH_OPTION: {
+                char* end;
+                walk_max_depth = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || walk_max_depth < 0) {
+                    fprintf(stderr, "Error: invalid depth: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'j': {
+                char* end;
+                worker_count = strtol(optarg, &end, 10);
+                if (*end != '\0' || worker_count < 1) {
+                    fprintf(stderr, "Error: invalid job count: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case INVALID_OPTION:
+                flags |= INVALID_ONLY_FLAG;
+                break;
+            case TIMEOUT_OPTION: {
+                char* end;
+                lock_timeout = strtod(optarg, &end);
+                if (end == optarg || *end != '\0' || !(lock_timeout >= 0)) {
+                    fprintf(stderr, "Error: invalid timeout: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case COMPACT_OPTION:
+                flags |= COMPACT_FLAG;
+                break;
+            case PACK_OPTION:
+                flags |= PACK_FLAG;
+                break;
+            case UNPACK_OPTION:
+                flags |= UNPACK_FLAG;
+                break;
+            case UNDER_OPTION:
+                under_dir = optarg;
+                flags |= UNDER_FLAG;
+                break;
+            case COUNTS_OPTION:
+                flags |= COUNTS_FLAG;
+                break;
+            case STATS_OPTION:
+                if (optarg && strcmp(optarg, "json") != 0 && strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "Error: --stats takes text or json\n");
+                    return EXIT_FAILURE;
+                }
+                stats_begin(optarg && strcmp(optarg, "json") == 0 ? STATS_JSON : STATS_TEXT);
+                break;
+            case CP_OPTION:
+            case MV_OPTION:
+            case RM_OPTION:
+                if (flags & FILEOP_FLAG) {
+                    fprintf(stderr, "Error: only one of --cp, --mv and --rm\n");
+                    return EXIT_FAILURE;
+                }
+                fileop = opt == CP_OPTION ? FILEOP_COPY : opt == MV_OPTION ? FILEOP_MOVE : FILEOP_REMOVE;
+                fileop_dest = optarg;
+                flags |= FILEOP_FLAG;
+                break;
+            case DAEMON_OPTION:
+                flags |= DAEMON_FLAG;
+                break;
+            case HASH_BENCH_OPTION:
+                flags |= HASH_BENCH_FLAG;
+                break;
+            case RANGE_OPTION: {
+                char* end;
+                errno = 0;
+                range_start = strtoull(optarg, &end, 10);
+                if (end != optarg && *end == ':' && optarg[0] != '-') {
+                    char* count = end + 1;
+                    range_count = strtoull(count, &end, 10);
+                    if (end != count && *end == '\0' && count[0] != '-' && errno == 0) {
+                        flags |= RANGE_FLAG;
+                        break;
+                    }
+                }
+                fprintf(stderr, "Error: invalid range: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
             case 'h':
                 return print_help();
             default:
@@ -981,6 +7070,72 @@ int main(int argc, char** argv) {
         }
     }
 
+    const char* hash_name = getenv("FSEL_HASH");
+    if (hash_name && strcmp(hash_name, "sha256") == 0) {
+        create_hash_algo = HASH_SHA256;
+    } else if (hash_name && *hash_name && strcmp(hash_name, "murmur3") != 0) {
+        fprintf(stderr, "Error: unknown FSEL_HASH: %s\n", hash_name);
+        return EXIT_FAILURE;
+    }
+
+    const char* sort_limit = getenv("FSEL_SORT_MEMORY");
+    if (sort_limit && *sort_limit) {
+        char* end;
+        unsigned long long limit = strtoull(sort_limit, &end, 10);
+        switch (*end) {
+            case 'G':
+            case 'g':
+                limit <<= 10;
+                /* fall through */
+            case 'M':
+            case 'm':
+                limit <<= 10;
+                /* fall through */
+            case 'K':
+            case 'k':
+                limit <<= 10;
+                end++;
+                break;
+        }
+        if (*end != '\0' || sort_limit[0] == '-' || limit < SORT_MEMORY_MIN) {
+            fprintf(stderr, "Error: invalid FSEL_SORT_MEMORY: %s (at least 1M)\n", sort_limit);
+            return EXIT_FAILURE;
+        }
+        sort_memory = (size_t)limit;
+    }
+
+    const char* sort_index = getenv("FSEL_SORT_INDEX");
+    if (sort_index && strcmp(sort_index, "0") == 0) {
+        use_sort_index = 0;
+    }
+
+    // Each command starts from the default selection, also in the daemon
+    if (setup_filenames(selection_name) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (flags & SETOP_FLAG) {
+        if (flags & ~(SETOP_FLAG | QUIET_FLAG | FORCE_FLAG)) {
+            fprintf(stderr, "Error: --union, --intersect and --diff only combine with -S, -q and -f\n");
+            return EXIT_FAILURE;
+        }
+        return setop_mode(argc - optind, argv + optind, flags);
+    }
+
+#ifdef FSEL_BENCH
+    if (flags & HASH_BENCH_FLAG) {
+        return hash_bench_mode(0, NULL, flags);
+    }
+#endif
+
+    if (flags & DAEMON_FLAG) {
+        if (in_daemon) {
+            fprintf(stderr, "Error: the daemon is already running\n");
+            return EXIT_FAILURE;
+        }
+        return daemon_mode(0, NULL, flags);
+    }
+
     if (flags & UNLOCK_FLAG) {
         return unlock_mode(0, NULL, flags);
     }
@@ -989,6 +7144,90 @@ int main(int argc, char** argv) {
         return validate_mode(0, NULL, flags);
     }
 
+    if (flags & COMPACT_FLAG) {
+        return compact_mode(0, NULL, flags);
+    }
+
+    if (flags & (PACK_FLAG | UNPACK_FLAG)) {
+        return pack_mode(0, NULL, flags);
+    }
+
+    if (flags & FILEOP_FLAG) {
+        // Long runs with per-path errors belong to the caller
+        if (in_daemon) {
+            return DAEMON_DECLINED;
+        }
+        if (flags & (EXEC_FLAG | DELETE_FLAG | REPLACE_FLAG | RECURSIVE_FLAG | LONG_FORMAT_FLAG | COUNTS_FLAG) ||
+            optind < argc) {
+            fprintf(stderr, "Error: --cp, --mv and --rm only combine with -s, -c, -j, --under and --range\n");
+            return EXIT_FAILURE;
+        }
+        if (flags & UNDER_FLAG) {
+            if (set_under_prefix(under_dir) != 0) {
+                return EXIT_FAILURE;
+            }
+            flags |= SORT_FLAG;
+        }
+        return fileop_mode(0, NULL, flags);
+    }
+
+    if (flags & EXEC_FLAG) {
+        // Commands run with the caller's environment, which only a direct
+        // call has
+        if (in_daemon) {
+            return DAEMON_DECLINED;
+        }
+        if (flags & (DELETE_FLAG | REPLACE_FLAG | RECURSIVE_FLAG | LONG_FORMAT_FLAG | COUNTS_FLAG) || optind < argc) {
+            fprintf(stderr, "Error: -x only combines with -s, -c, -j, --under and --range\n");
+            return EXIT_FAILURE;
+        }
+        if (flags & UNDER_FLAG) {
+            if (set_under_prefix(under_dir) != 0) {
+                return EXIT_FAILURE;
+            }
+            flags |= SORT_FLAG;
+        }
+        return exec_mode(0, NULL, flags);
+    }
+
+    if (flags & (UNDER_FLAG | COUNTS_FLAG)) {
+        if (flags & (CLEAR_FLAG | REPLACE_FLAG | RECURSIVE_FLAG) ||
+            (flags & COUNTS_FLAG && flags & (DELETE_FLAG | LONG_FORMAT_FLAG | RANGE_FLAG))) {
+            fprintf(stderr, "Error: incompatible options with --under or --counts\n");
+            return EXIT_FAILURE;
+        }
+        if (optind < argc) {
+            fprintf(stderr, "Error: --under takes no other paths\n");
+            return EXIT_FAILURE;
+        }
+        if (set_under_prefix(under_dir ? under_dir : "/") != 0) {
+            return EXIT_FAILURE;
+        }
+        if (flags & DELETE_FLAG) {
+            return delete_mode(0, NULL, flags);
+        }
+        // Subtrees come out of the sort index, so they list sorted
+        return list_mode(0, NULL, flags | SORT_FLAG);
+    }
+
+    if (flags & RANGE_FLAG) {
+        // A window is always a listing, even when stdin is not a terminal
+        if (flags & (CLEAR_FLAG | DELETE_FLAG | REPLACE_FLAG) || optind < argc) {
+            fprintf(stderr, "Error: --range only applies to listing\n");
+            return EXIT_FAILURE;
+        }
+        return list_mode(0, NULL, flags);
+    }
+
+    if ((walk_name || walk_type || walk_max_depth >= 0) && !(flags & RECURSIVE_FLAG)) {
+        fprintf(stderr, "Error: --name, --type and --maxdepth need -R\n");
+        return EXIT_FAILURE;
+    }
+    if (flags & RECURSIVE_FLAG && flags & DELETE_FLAG) {
+        fprintf(stderr, "Error: incompatible options -d and -R\n");
+        return EXIT_FAILURE;
+    }
+
     if (flags & CLEAR_FLAG && optind >= argc) {
         return clear_mode(0, NULL, flags);
     }
@@ -1015,3 +7254,44 @@ int main(int argc, char** argv) {
     // When paths are provided, use add mode
     return add_mode(argc - optind, argv + optind, flags);
 }
+
+// Run one command, then report its counters when --stats or FSEL_STATS
+// (1 or json) asks for them
+int run_command(int argc, char** argv) {
+    memset(&stats, 0, sizeof(stats));
+    stats_format = 0;
+    const char* env = getenv("FSEL_STATS");
+    if (env && *env && strcmp(env, "0") != 0) {
+        stats_begin(strcmp(env, "json") == 0 ? STATS_JSON : STATS_TEXT);
+    }
+    int rc = dispatch_command(argc, argv);
+    if (stats_format && rc != DAEMON_DECLINED) {
+        fflush(stdout);
+        stats_report(rc);
+    }
+    return rc;
+}
+
+int main(int argc, char** argv) {
+    if (setup_filenames(NULL) != 0) {
+        return EXIT_FAILURE;
+    }
+    const char* name = strrchr(argv[0], '/');
+    name = name ? name + 1 : argv[0];
+    if (strcmp(name, "fseld") == 0) {
+        return daemon_mode(0, NULL, 0);
+    }
+    // Hand the command to a running daemon unless this starts one
+    const char* no_daemon = getenv("FSEL_NO_DAEMON");
+    int use_daemon = !(no_daemon && *no_daemon && strcmp(no_daemon, "0") != 0);
+    for (int i = 1; i < argc && use_daemon; i++) {
+        if (strcmp(argv[i], "--daemon") == 0) {
+            use_daemon = 0;
+        }
+    }
+    int status;
+    if (use_daemon && daemon_call(argc, argv, &status) == 0) {
+        return status;
+    }
+    return run_command(argc, argv);
+}
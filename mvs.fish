@@ -1,8 +1,4 @@
 # Like a "mv" command, but for selected by "fsel" files.
 function mvs
-    for f in (fsel)
-        mv $f $argv
-    end
-    fsel -c
+    fsel --mv $argv[1]
 end
-
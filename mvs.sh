@@ -1,4 +1,4 @@
 #!/bin/sh
-# Like a "mv" command, but for selected by "fargs" files.
-for f in $(fsel); do mv $f $argv; done
-fsel -c
+# Like a "mv" command, but for selected by "fsel" files.
+# Usage: mvs DEST. Moved paths leave the selection as they go.
+exec fsel --mv "$1"
@@ -1,9 +1,5 @@
 # Like a "rm" command, but for selected by "fsel" files.
-# Dangerous! By default uses option for recursive removal.
+# Dangerous! Directories are removed recursively.
 function rms
-    for f in (fsel)
-        rm -rf $f $argv
-    end
-    fsel -c
+    fsel --rm
 end
-
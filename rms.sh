@@ -1,5 +1,4 @@
 #!/bin/sh
-# Like a "rm" command, but for selected by "fargs" files.
-# Dangerous! By default uses option for recursive removal.
-for f in $(fsel); do rm -rf $f $argv; done
-fsel -c
+# Like a "rm" command, but for selected by "fsel" files.
+# Dangerous! Directories are removed recursively.
+exec fsel --rm